@@ -3,7 +3,12 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <array>
 #include <map>
+#include <string_view>
+#include <span>
+#include <new>
+#include <charconv>
 #include <limits> 
 #include <istream>
 #include <iomanip>
@@ -13,7 +18,28 @@
 #include <cstdlib>
 #include <filesystem>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <cerrno>
+#include <chrono>
+#include <bit>
+#include <sys/resource.h>
+#include <cstdio>
 #include <unistd.h>
+#include <memory>
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <algorithm>
+#include <utility>
 
 extern "C" {  // jpeglib.h
 #include <stdio.h>
@@ -28,9 +54,420 @@ extern "C" {  // jpeglib.h
 #define MICROSTEP           16  // микрошаг (1, 2, 4, 8 и т. д.)
 #define BELT_PITCH          2  // шаг ремня (например, 2 мм)
 #define NUMBER_TEETH_PULLEY 20  // количество зубьев на шкиве, на валу двигателя.
+#define Z_STEPS_PER_MM      400  // шагов на мм винта оси Z
+#define E_STEPS_PER_MM      93  // шагов на мм прутка экструдера
+#define TABLE_SIZE_MM       220  // сторона квадратного стола, мм
+#define PIXELS_PER_MM       10  // точек растра на мм (точка 0.1 мм)
 
 const std::string FILE_NAME = "CE3E3V2_xyzCalibration_cube.gcode";
 
+enum class LogLevel : int {
+    TRACE = 0,
+    DEBUG,
+    INFO,
+    WARN,
+    ERROR,
+    OFF
+};
+
+// Сообщения ниже этого уровня вырезаются при компиляции: -DLOG_COMPILED_LEVEL=2 оставит INFO и выше
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL 0
+#endif
+
+enum class LogFormat {
+    TEXT,  // только текст сообщения
+    JSON   // одна строка JSON на событие: время, уровень, событие, текст
+};
+
+/** @brief Журнал с буферизацией: сообщения копятся в буфере и пишутся в stdout пачками по FLUSH_SIZE,
+ *         WARN и выше сбрасываются сразу. В асинхронном режиме запись идет в фоновом потоке.
+ *         Сообщение собирается только если уровень включен, см. LOG()
+ * */
+class Logger {
+public:
+    static constexpr size_t FLUSH_SIZE = ( size_t(1) << 16 );
+
+private:
+    std::atomic<int> level{ int( LogLevel::INFO ) };
+    LogFormat format = LogFormat::TEXT;
+    bool async = false;
+    bool stopping = false;
+    std::string buffer;
+    std::mutex mutex;
+    std::mutex output;  // порядок записи пачек, берется раньше mutex
+    std::condition_variable full;
+    std::thread writer;
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    static const char* name( const LogLevel& lvl ) noexcept {
+        static constexpr const char* names[] = { "trace", "debug", "info", "warn", "error", "off" };
+        return names[int( lvl )];
+    }
+
+    static void escape( std::string& out, const std::string_view& text ) {
+        for( const char& c : text ) {
+            switch( c ) {
+                case '"': out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\n': out += "\\n"; break;
+                case '\t': out += "\\t"; break;
+                case '\r': out += "\\r"; break;
+                default:
+                    if( static_cast<unsigned char>( c ) < 0x20 ) {
+                        char code[8];
+                        std::snprintf( code, sizeof(code), "\\u%04x", c );
+                        out += code;
+                    } else
+                        out += c;
+            }
+        }
+    }
+
+    /** @brief Записать накопленное. Вызывается с захваченным output
+     * */
+    void drain() {
+        std::string chunk;
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            chunk.swap( buffer );
+        }
+        if( !chunk.empty() ) {
+            std::fwrite( chunk.data(), 1, chunk.size(), stdout );
+            std::fflush( stdout );
+        }
+    }
+
+    void work() {
+        while( true ) {
+            {
+                std::unique_lock<std::mutex> lock( mutex );
+                full.wait( lock, [this]() { return ( stopping || ( buffer.size() >= FLUSH_SIZE ) ); } );
+                if( stopping && buffer.empty() )
+                    return;
+            }
+            std::lock_guard<std::mutex> lock( output );
+            drain();
+        }
+    }
+
+    void stop() {
+        if( !writer.joinable() )
+            return;
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            stopping = true;
+        }
+        full.notify_all();
+        writer.join();
+        stopping = false;
+    }
+
+    Logger() = default;
+
+public:
+    Logger( const Logger& ) = delete;
+    Logger& operator=( const Logger& ) = delete;
+
+    ~Logger() {
+        stop();
+        flush();
+    }
+
+    static Logger& instance() {
+        static Logger logger;
+        return logger;
+    }
+
+    /** @param asyncWrite Писать пачки в фоновом потоке
+     * */
+    void configure( const LogLevel& lvl, const LogFormat& fmt, const bool& asyncWrite ) {
+        flush();
+        stop();
+        level = int( lvl );
+        format = fmt;
+        async = asyncWrite;
+        if( async )
+            writer = std::thread( &Logger::work, this );
+    }
+
+    bool enabled( const LogLevel& lvl ) const noexcept {
+        return ( int( lvl ) >= level.load( std::memory_order_relaxed ) );
+    }
+
+    void write( const LogLevel& lvl, const std::string_view& event, const std::string_view& text ) {
+        bool overflow = false;
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            if( format == LogFormat::JSON ) {
+                const double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+                char head[64];
+                std::snprintf( head, sizeof(head), "{\"ts\":%.6f,\"level\":\"%s\",\"event\":\"", seconds, name( lvl ) );
+                buffer += head;
+                escape( buffer, event );
+                buffer += "\",\"msg\":\"";
+                escape( buffer, text );
+                buffer += "\"}\n";
+            } else {
+                buffer += text;
+                buffer += '\n';
+            }
+            overflow = ( buffer.size() >= FLUSH_SIZE );
+        }
+        if( lvl >= LogLevel::WARN )
+            flush();
+        else if( overflow ) {
+            if( async )
+                full.notify_one();
+            else
+                flush();
+        }
+    }
+
+    /** @brief Записать все накопленные сообщения
+     * */
+    void flush() {
+        std::lock_guard<std::mutex> lock( output );
+        drain();
+    }
+};
+
+/** @brief Записать сообщение: LOG( INFO, "motors", "text " << value ). Ниже LOG_COMPILED_LEVEL вызов
+ *         вырезается при компиляции, выключенный уровень стоит одной проверки, текст не собирается
+ * */
+#define LOG( lvl, event, text ) \
+    do { \
+        if constexpr ( int( LogLevel::lvl ) >= LOG_COMPILED_LEVEL ) { \
+            if( Logger::instance().enabled( LogLevel::lvl ) ) { \
+                std::ostringstream logText_; \
+                logText_ << text; \
+                Logger::instance().write( LogLevel::lvl, event, logText_.str() ); \
+            } \
+        } \
+    } while( false )
+
+// Замеры этапов и счетчики, -DPROFILE_ENABLED=0 убирает их при компиляции полностью
+#ifndef PROFILE_ENABLED
+#define PROFILE_ENABLED 1
+#endif
+
+/** @brief Профилировщик: таймеры этапов, счетчики, число команд по кодам и гистограмма задержки слоя
+ *         от постановки в очередь до записи. У каждого потока своя статистика, на которую указывает
+ *         thread_local, поэтому запись идет без блокировок; общий мьютекс берется один раз на поток
+ *         при регистрации. Пока профилирование не включено, каждый замер стоит одной проверки флага.
+ *         Отчет в JSON или в формате Chrome trace (chrome://tracing, Perfetto) пишется в dump()
+ * */
+class Profiler {
+public:
+    enum Stage : size_t {
+        MAKE,      // весь разбор Arbitr::make()
+        PARSE,     // GCodeLine::parse
+        DISPATCH,  // выполнение команды
+        RASTER,    // рисование отрезков слоя
+        EXPORT,    // копирование слоя в плотную матрицу
+        ENCODE,    // кодирование слоя
+        WRITE,     // запись слоя
+        MIPS,      // уменьшение слоя для миниатюр
+        PRESCAN,   // поиск границ слоев перед разбором участками
+        SHARD,     // участок слоев в своем потоке
+        STAGES
+    };
+
+    enum Counter : size_t {
+        LINES,     // строк разобрано
+        SEGMENTS,  // отрезков нарисовано
+        PIXELS,    // точек записано
+        LAYERS,    // слоев записано
+        BYTES,     // байт закодировано
+        COUNTERS
+    };
+
+    static constexpr size_t LATENCY_BUCKETS = 32;  // корзина k: задержка < 2^k мкс
+
+private:
+    static constexpr const char* STAGE_NAMES[STAGES] = { "make", "parse", "dispatch", "raster", "export", "encode",
+        "write", "mips", "prescan", "shard" };
+    static constexpr bool TRACED[STAGES] = { true, false, false, true, true, true, true, true, true, true };
+    static constexpr const char* COUNTER_NAMES[COUNTERS] = { "lines", "segments", "pixels", "layers", "bytes" };
+    static constexpr size_t TRACE_LIMIT = ( size_t(1) << 20 );
+
+    struct TraceEvent {
+        Stage stage;
+        int64_t start;  // нс от запуска
+        int64_t duration;
+    };
+
+    struct ThreadStats {
+        size_t id;
+        std::array<int64_t, STAGES> nanoseconds{};
+        std::array<uint64_t, STAGES> calls{};
+        std::array<uint64_t, COUNTERS> counters{};
+        std::array<uint64_t, LATENCY_BUCKETS> latency{};
+        std::unordered_map<uint32_t, uint64_t> opcodes;
+        std::vector<TraceEvent> trace;
+    };
+
+    std::atomic<bool> active{ false };
+    bool chrome = false;
+    std::string path;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadStats>> threads;
+    const std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+
+    Profiler() = default;
+
+    ThreadStats& stats() {
+        thread_local ThreadStats* local = nullptr;
+        if( local == nullptr ) {
+            std::lock_guard<std::mutex> lock( mutex );
+            threads.push_back( std::make_unique<ThreadStats>() );
+            threads.back()->id = threads.size();
+            local = threads.back().get();
+        }
+        return *local;
+    }
+
+    void writeJson( std::ostream& out ) const {
+        std::array<int64_t, STAGES> nanoseconds{};
+        std::array<uint64_t, STAGES> calls{};
+        std::array<uint64_t, COUNTERS> counters{};
+        std::array<uint64_t, LATENCY_BUCKETS> latency{};
+        std::map<uint32_t, uint64_t> opcodes;
+        for( const auto& t : threads ) {
+            for( size_t i = 0; i < STAGES; ++i ) {
+                nanoseconds[i] += t->nanoseconds[i];
+                calls[i] += t->calls[i];
+            }
+            for( size_t i = 0; i < COUNTERS; ++i )
+                counters[i] += t->counters[i];
+            for( size_t i = 0; i < LATENCY_BUCKETS; ++i )
+                latency[i] += t->latency[i];
+            for( const auto& [op, count] : t->opcodes )
+                opcodes[op] += count;
+        }
+        out << "{\n  \"threads\": " << threads.size() << ",\n  \"stages\": {";
+        for( size_t i = 0; i < STAGES; ++i )
+            out << ( ( i == 0 ) ? "\n" : ",\n" ) << "    \"" << STAGE_NAMES[i] << "\": { \"ms\": " << std::fixed
+                << std::setprecision(3) << ( nanoseconds[i] / 1e6 ) << ", \"calls\": " << calls[i] << " }";
+        out << "\n  },\n  \"counters\": {";
+        for( size_t i = 0; i < COUNTERS; ++i )
+            out << ( ( i == 0 ) ? "\n" : ",\n" ) << "    \"" << COUNTER_NAMES[i] << "\": " << counters[i];
+        out << "\n  },\n  \"opcodes\": {";
+        bool first = true;
+        for( const auto& [op, count] : opcodes ) {
+            out << ( first ? "\n" : ",\n" ) << "    \"" << char( op >> 16 ) << ( op & 0xFFFF ) << "\": " << count;
+            first = false;
+        }
+        out << "\n  },\n  \"layerLatencyUs\": [";
+        for( size_t i = 0; i < LATENCY_BUCKETS; ++i )
+            out << ( ( i == 0 ) ? "" : ", " ) << latency[i];
+        out << "]\n}\n";
+    }
+
+    void writeChrome( std::ostream& out ) const {
+        out << "{\"traceEvents\":[";
+        bool first = true;
+        for( const auto& t : threads )
+            for( const TraceEvent& e : t->trace ) {
+                out << ( first ? "\n" : ",\n" ) << "{\"name\":\"" << STAGE_NAMES[e.stage] << "\",\"ph\":\"X\",\"pid\":1,"
+                    << "\"tid\":" << t->id << ",\"ts\":" << std::fixed << std::setprecision(3) << ( e.start / 1e3 )
+                    << ",\"dur\":" << ( e.duration / 1e3 ) << "}";
+                first = false;
+            }
+        out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    }
+
+public:
+    Profiler( const Profiler& ) = delete;
+    Profiler& operator=( const Profiler& ) = delete;
+
+    static Profiler& instance() {
+        static Profiler profiler;
+        return profiler;
+    }
+
+    /** @param file Куда записать отчет
+     *  @param chromeTrace Записать события этапов в формате Chrome trace вместо сводки JSON
+     * */
+    void configure( const std::string& file, const bool& chromeTrace ) {
+        path = file;
+        chrome = chromeTrace;
+        active = !file.empty();
+    }
+
+    bool enabled() const noexcept { return active.load( std::memory_order_relaxed ); }
+
+    int64_t now() const noexcept {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - origin ).count();
+    }
+
+    void record( const Stage& stage, const int64_t& start, const int64_t& end ) {
+        ThreadStats& t = stats();
+        t.nanoseconds[stage] += ( end - start );
+        ++t.calls[stage];
+        if( chrome && TRACED[stage] && ( t.trace.size() < TRACE_LIMIT ) )
+            t.trace.push_back( TraceEvent{ stage, start, ( end - start ) } );
+    }
+
+    void count( const Counter& counter, const uint64_t& value ) { stats().counters[counter] += value; }
+    void opcode( const uint32_t& op ) { ++stats().opcodes[op]; }
+
+    void latency( const int64_t& nanoseconds ) {
+        const uint64_t us = uint64_t( std::max<int64_t>( nanoseconds / 1000, 0 ) );
+        stats().latency[std::min<size_t>( ( std::bit_width( us ) ), ( LATENCY_BUCKETS - 1 ) )] += 1;
+    }
+
+    /** @brief Записать отчет. Вызывать, когда все рабочие потоки уже остановлены
+     * */
+    void dump() {
+        if( !enabled() )
+            return;
+        std::lock_guard<std::mutex> lock( mutex );
+        std::ofstream out( path, std::ios::trunc );
+        if( chrome )
+            writeChrome( out );
+        else
+            writeJson( out );
+        if( !out )
+            LOG( WARN, "profile", "Не удалось записать отчет профилировщика: " << path );
+    }
+};
+
+/** @brief Замер этапа от создания до конца области видимости
+ * */
+class ProfileScope {
+    Profiler::Stage stage;
+    int64_t start;
+
+public:
+    explicit ProfileScope( const Profiler::Stage& stage ) : stage(stage),
+            start( Profiler::instance().enabled() ? Profiler::instance().now() : -1 ) {}
+
+    ~ProfileScope() {
+        if( start >= 0 )
+            Profiler::instance().record( stage, start, Profiler::instance().now() );
+    }
+};
+
+#if PROFILE_ENABLED
+#define PROFILE_CONCAT_( a, b ) a##b
+#define PROFILE_NAME_( line ) PROFILE_CONCAT_( profileScope_, line )
+#define PROFILE_SCOPE( stage ) const ProfileScope PROFILE_NAME_( __LINE__ )( Profiler::stage )
+#define PROFILE_COUNT( counter, value ) \
+    do { if( Profiler::instance().enabled() ) Profiler::instance().count( Profiler::counter, ( value ) ); } while( false )
+#define PROFILE_OPCODE( op ) \
+    do { if( Profiler::instance().enabled() ) Profiler::instance().opcode( ( op ) ); } while( false )
+#define PROFILE_NOW() ( Profiler::instance().enabled() ? Profiler::instance().now() : int64_t(-1) )
+#define PROFILE_LATENCY( start ) \
+    do { if( ( start ) >= 0 ) Profiler::instance().latency( ( Profiler::instance().now() - ( start ) ) ); } while( false )
+#else
+#define PROFILE_SCOPE( stage ) do {} while( false )
+#define PROFILE_COUNT( counter, value ) do {} while( false )
+#define PROFILE_OPCODE( op ) do {} while( false )
+#define PROFILE_NOW() int64_t(-1)
+#define PROFILE_LATENCY( start ) do {} while( false )
+#endif
+
 class Matrix;
 
 /** @brief Ошибка матрицы, с выводом сообщения
@@ -54,8 +491,308 @@ public:
 class OutOfRange : public MatrixException {
 public:
     OutOfRange(size_t i, size_t j, const Matrix &matrix);
+    OutOfRange(size_t i, size_t j, size_t rows, size_t cols);
+};
+
+
+/** @brief Обработчик ошибок libjpeg: вместо exit() возвращает управление через longjmp
+ * */
+struct JpegError {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+    char message[JMSG_LENGTH_MAX];
+
+    static void exit( j_common_ptr cinfo ) {
+        JpegError* err = reinterpret_cast<JpegError*>( cinfo->err );
+        ( *cinfo->err->format_message )( cinfo, err->message );
+        longjmp( err->jump, 1 );
+    }
 };
 
+/** @brief Отрезок алгоритмом Брезенхэма
+ *  @param plot Вызывается для каждой точки отрезка, включая концы
+ * */
+template<typename Plot>
+void bresenhamLine( int x0, int y0, int x1, int y1, Plot&& plot ) {
+    int A = ( y1 - y0 ), B = ( x0 - x1 );
+    int sign = ( ( std::abs(A) > std::abs(B) ) ? 1 : -1 );
+    int signa = ( ( A < 0 ) ? -1 : 1 ), signb = ( ( B < 0 ) ? -1 : 1 );
+    int f = 0;
+    plot( x0, y0 );
+    int x = x0, y = y0;
+    if( sign == -1 ) {
+        do {
+            f += ( A * signa );
+            if( f > 0 ) {
+                f -= ( B * signb );
+                y += signa;
+            }
+            x -= signb;
+            plot( x, y );
+        } while (x != x1 || y != y1);
+    } else {
+        do {
+            f += B * signb;
+            if( f > 0 ) {
+                f -= A * signa;
+                x -= signb;
+            }
+            y += signa;
+            plot( x, y );
+        } while( ( x != x1 ) || ( y != y1 ) );
+    }
+}
+
+/** @brief bresenhamLine(), выдающий только точки строк firstRow..lastRow. Шаги до первой такой строки
+ *         не проходятся, а вычисляются сразу: после k шагов по ведущей оси число шагов по второй равно
+ *         ceil( k * minor / major ), накопленная ошибка - остаток. После последней строки обход
+ *         прекращается. Точки совпадают с точками полного обхода в этих строках
+ * */
+template<typename Plot>
+void bresenhamLine( const int& x0, const int& y0, const int& x1, const int& y1, const int& firstRow,
+        const int& lastRow, Plot&& plot ) {
+    const int signa = ( ( y1 < y0 ) ? -1 : 1 ), signb = ( ( x0 < x1 ) ? -1 : 1 );
+    const int64_t q = std::abs( ( y1 - y0 ) ), p = std::abs( ( x0 - x1 ) );
+    // первая и последняя строки полосы по ходу отрезка
+    const int entry = ( ( signa > 0 ) ? std::max( y0, firstRow ) : std::min( y0, lastRow ) );
+    const int exit = ( ( signa > 0 ) ? std::min( y1, lastRow ) : std::max( y1, firstRow ) );
+    if( ( ( signa > 0 ) ? ( entry > exit ) : ( entry < exit ) ) || ( ( p == 0 ) && ( q == 0 ) ) ) {
+        if( ( p == 0 ) && ( q == 0 ) && ( y0 >= firstRow ) && ( y0 <= lastRow ) )
+            plot( x0, y0 );
+        return;
+    }
+    const int64_t d = std::abs( ( entry - y0 ) );
+    if( q > p ) {
+        // шаг по y на каждой итерации
+        const int64_t n = ( ( d * p + q - 1 ) / q );
+        int x = int( x0 - signb * n ), y = entry;
+        int64_t f = ( d * p - n * q );
+        plot( x, y );
+        while( y != exit ) {
+            f += p;
+            if( f > 0 ) {
+                f -= q;
+                x -= signb;
+            }
+            y += signa;
+            plot( x, y );
+        }
+        return;
+    }
+    // шаг по x на каждой итерации: первый шаг k, на котором y доходит до строки entry
+    const int64_t k = ( ( d == 0 ) ? 0 : ( ( ( d - 1 ) * p ) / q + 1 ) );
+    int x = int( x0 - signb * k ), y = entry;
+    int64_t f = ( k * q - d * p );
+    plot( x, y );
+    while( ( x != x1 ) || ( y != y1 ) ) {
+        f += q;
+        if( f > 0 ) {
+            f -= p;
+            if( y == exit )
+                return;
+            y += signa;
+        }
+        x -= signb;
+        plot( x, y );
+    }
+}
+
+/** @brief Растеризация отрезка как капсулы: все точки на расстоянии не больше radius от отрезка.
+ *         Капсула выпуклая, поэтому ее пересечение с каждой строкой - один отрезок [xl, xr], который
+ *         считается аналитически без проверки каждой точки. Строки и отрезки обрезаются по растру.
+ *         При сглаживании внутренний отрезок строки (радиус radius - 0.5) выдается одним сплошным
+ *         отрезком, а покрытие считается только для краевых точек по расстоянию до оси
+ *  @param firstRow Первая строка растра, которую можно рисовать
+ *  @param lastRow Последняя строка растра, которую можно рисовать
+ *  @param cols Колонки растра
+ *  @param span Вызывается как span( y, first, last, coverage ) для точек first..last строки y,
+ *              coverage - покрытие 1..255, 255 для сплошных отрезков
+ * */
+template<typename Span>
+void capsuleLine( float x0, float y0, float x1, float y1, float radius, const bool& antialias,
+        const int& firstRow, const int& lastRow, const int& cols, Span&& span ) {
+    radius = std::max( radius, 0.5f );
+    const float dx = ( x1 - x0 ), dy = ( y1 - y0 );
+    const float length = std::sqrt( ( dx * dx + dy * dy ) );
+    const float ux = ( ( length > 1e-6f ) ? ( dx / length ) : 1.0f );
+    const float uy = ( ( length > 1e-6f ) ? ( dy / length ) : 0.0f );
+
+    // Отрезок строки y, где расстояние до оси не больше r: объединение пересечений двух кругов
+    // и прямоугольника, для выпуклой фигуры это один отрезок
+    const auto row = [&]( const float& y, const float& r, float& xl, float& xr ) {
+        xl = std::numeric_limits<float>::max();
+        xr = std::numeric_limits<float>::lowest();
+        for( const auto& [cx, cy] : { std::pair<float, float>( x0, y0 ), std::pair<float, float>( x1, y1 ) } ) {
+            const float h = ( r * r - ( y - cy ) * ( y - cy ) );
+            if( h < 0 )
+                continue;
+            xl = std::min( xl, ( cx - std::sqrt( h ) ) );
+            xr = std::max( xr, ( cx + std::sqrt( h ) ) );
+        }
+        // lo <= a * x + b <= hi для оси ( 0..length ) и нормали ( -r..r )
+        float bl = std::numeric_limits<float>::lowest(), br = std::numeric_limits<float>::max();
+        const auto clip = [&]( const float& a, const float& b, const float& lo, const float& hi ) {
+            if( std::fabs( a ) < 1e-6f ) {
+                if( ( b < lo ) || ( b > hi ) )
+                    br = bl - 1;
+                return;
+            }
+            const float t0 = ( ( lo - b ) / a ), t1 = ( ( hi - b ) / a );
+            bl = std::max( bl, std::min( t0, t1 ) );
+            br = std::min( br, std::max( t0, t1 ) );
+        };
+        clip( ux, ( ( y - y0 ) * uy - x0 * ux ), 0, length );
+        clip( -uy, ( ( y - y0 ) * ux + x0 * uy ), -r, r );
+        if( bl <= br ) {
+            xl = std::min( xl, bl );
+            xr = std::max( xr, br );
+        }
+        return ( xl <= xr );
+    };
+    const auto coverage = [&]( const float& x, const float& y ) {
+        const float t = std::clamp( ( ( x - x0 ) * ux + ( y - y0 ) * uy ), 0.0f, length );
+        // std::hypot без его медленной защиты от переполнения: в double сумма квадратов float точна
+        const double ex = ( x - x0 - t * ux ), ey = ( y - y0 - t * uy );
+        const float d = float( std::sqrt( ( ex * ex + ey * ey ) ) );
+        return uint8_t( std::lround( ( std::clamp( ( radius + 0.5f - d ), 0.0f, 1.0f ) * 255 ) ) );
+    };
+
+    const float outer = ( antialias ? ( radius + 0.5f ) : radius );
+    const float inner = ( radius - 0.5f );
+    const int top = std::max( firstRow, int( std::ceil( ( std::min( y0, y1 ) - outer ) ) ) );
+    const int bottom = std::min( lastRow, int( std::floor( ( std::max( y0, y1 ) + outer ) ) ) );
+    for( int y = top; y <= bottom; ++y ) {
+        float xl, xr;
+        if( !row( float(y), outer, xl, xr ) )
+            continue;
+        const int first = std::max( 0, int( std::ceil( xl ) ) );
+        const int last = std::min( ( cols - 1 ), int( std::floor( xr ) ) );
+        if( first > last )
+            continue;
+        if( !antialias ) {
+            span( y, first, last, uint8_t(255) );
+            continue;
+        }
+        int solidFirst = ( last + 1 ), solidLast = last;
+        if( ( inner > 0 ) && row( float(y), inner, xl, xr ) ) {
+            solidFirst = std::max( first, int( std::ceil( xl ) ) );
+            solidLast = std::min( last, int( std::floor( xr ) ) );
+        }
+        if( solidFirst > solidLast )
+            solidFirst = solidLast = ( last + 1 );
+        for( int x = first; x < std::min( solidFirst, ( last + 1 ) ); ++x )
+            if( const uint8_t c = coverage( float(x), float(y) ) )
+                span( y, x, x, c );
+        if( solidFirst <= last )
+            span( y, solidFirst, solidLast, uint8_t(255) );
+        for( int x = std::max( first, ( solidLast + 1 ) ); x <= last; ++x )
+            if( const uint8_t c = coverage( float(x), float(y) ) )
+                span( y, x, x, c );
+    }
+}
+
+/** @brief Версии функции под разные наборы инструкций с выбором при запуске (SSE2/AVX2 на x86-64).
+ *         На aarch64 NEON входит в базовый набор, и цикл векторизуется без клонов
+ * */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__) && !defined(__APPLE__)
+#define MATRIX_KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define MATRIX_KERNEL
+#endif
+
+/** @brief Массовые операции над буферами матриц. Заполнение, копирование и сравнение
+ *         делегируются memset/memcpy/memcmp, которые в libc уже выбираются под процессор.
+ *         Перевод в серый выполняется в целых числах (BT.601, веса 77/150/29 из 256) и векторизуется
+ * */
+struct MatrixKernels {
+    static void fill( uint8_t* dst, const uint8_t& value, const size_t& size ) noexcept {
+        if( size != 0 )
+            std::memset( dst, value, size );
+    }
+
+    static void copy( uint8_t* dst, const uint8_t* src, const size_t& size ) noexcept {
+        if( size != 0 )
+            std::memcpy( dst, src, size );
+    }
+
+    static bool equal( const uint8_t* lhs, const uint8_t* rhs, const size_t& size ) noexcept {
+        return ( ( size == 0 ) || ( std::memcmp( lhs, rhs, size ) == 0 ) );
+    }
+
+    /** @brief dst[i] = max( dst[i], value ) - наложение сглаженных краев без затирания ярких точек
+     * */
+    MATRIX_KERNEL
+    static void maximum( uint8_t* __restrict dst, const uint8_t value, const size_t size ) noexcept {
+        for( size_t i = 0; i < size; ++i )
+            dst[i] = std::max( dst[i], value );
+    }
+
+    /** @brief dst[i] = max( dst[i], src[i] ) - сложение строк при уменьшении с сохранением тонких линий
+     * */
+    MATRIX_KERNEL
+    static void maximum( uint8_t* __restrict dst, const uint8_t* __restrict src, const size_t size ) noexcept {
+        for( size_t i = 0; i < size; ++i )
+            dst[i] = std::max( dst[i], src[i] );
+    }
+
+    /** @brief dst[j] - максимум из src[j * factor .. ( j + 1 ) * factor), последняя группа может быть короче
+     *  @param size Точек в src
+     * */
+    MATRIX_KERNEL
+    static void reduceMax( const uint8_t* __restrict src, const size_t size, const size_t factor,
+            uint8_t* __restrict dst ) noexcept {
+        const size_t whole = ( size / factor );
+        for( size_t j = 0; j < whole; ++j ) {
+            uint8_t v = 0;
+            for( size_t k = 0; k < factor; ++k )
+                v = std::max( v, src[( j * factor + k )] );
+            dst[j] = v;
+        }
+        if( ( whole * factor ) < size ) {
+            uint8_t v = 0;
+            for( size_t k = ( whole * factor ); k < size; ++k )
+                v = std::max( v, src[k] );
+            dst[whole] = v;
+        }
+    }
+
+    /** @brief Перевод строки RGB в градации серого
+     *  @param rgb Точки подряд по 3 байта R, G, B
+     *  @param grey Результат, size байт
+     * */
+    MATRIX_KERNEL
+    static void rgbToGrey( const uint8_t* __restrict rgb, uint8_t* __restrict grey, const size_t size ) noexcept {
+        for( size_t i = 0; i < size; ++i )
+            grey[i] = uint8_t( ( 77u * rgb[3 * i] + 150u * rgb[3 * i + 1] + 29u * rgb[3 * i + 2] + 128u ) >> 8 );
+    }
+
+    /** @brief Первая и последняя ненулевые точки строки, проверка идет по 8 байт
+     *  @return false, если строка нулевая
+     * */
+    static bool extent( const uint8_t* row, const size_t& size, size_t& first, size_t& last ) noexcept {
+        size_t i = 0;
+        for( uint64_t word = 0; ( i + 8 ) <= size; i += 8 ) {
+            std::memcpy( &word, ( row + i ), 8 );
+            if( word != 0 )
+                break;
+        }
+        while( ( i < size ) && ( row[i] == 0 ) )
+            ++i;
+        if( i == size )
+            return false;
+        first = i;
+        size_t j = size;
+        for( uint64_t word = 0; ( j >= ( i + 8 ) ); j -= 8 ) {
+            std::memcpy( &word, ( row + j - 8 ), 8 );
+            if( word != 0 )
+                break;
+        }
+        while( row[( j - 1 )] == 0 )
+            --j;
+        last = ( j - 1 );
+        return true;
+    }
+};
 
 /* @class Matrix класс матрицы двумерной. Различные операции для расчетов
  * @param rows Строки
@@ -63,14 +800,37 @@ public:
  * @param matrix Массив элементов матрицы
  * */
 class Matrix {
+public:
+    static constexpr size_t ALIGNMENT = 64;
+
+    /** @brief Строка матрицы только для чтения
+     * */
+    using Row = std::span<const uint8_t>;
+
 private:
+    struct AlignedDelete {
+        void operator()( uint8_t* p ) const noexcept { ::operator delete[]( p, std::align_val_t( ALIGNMENT ) ); }
+    };
+    using Buffer = std::unique_ptr<uint8_t[], AlignedDelete>;
+
     size_t rows;
     size_t cols;
-    uint8_t* matrix;
+    size_t capacity;
+    Buffer matrix;
 
-    static inline uint8_t get_grey(const uint8_t& R, const uint8_t& G, const uint8_t& B) {
-        return  uint8_t(float(R) * float(0.299) + float(G) * float(0.587) + float(B) * float(0.114));
+    static Buffer allocate( const size_t& size ) {
+        if( size == 0 )
+            return Buffer();
+        return Buffer( static_cast<uint8_t*>( ::operator new[]( size, std::align_val_t( ALIGNMENT ) ) ) );
     }
+
+    /** @brief Записать точку, если она лежит в пределах матрицы
+     * */
+    inline void set( const int& x, const int& y, const uint8_t& color ) noexcept {
+        if( ( x >= 0 ) && ( y >= 0 ) && ( size_t(x) < cols ) && ( size_t(y) < rows ) )
+            matrix[( x + ( y * cols ) )] = color;
+    }
+
 public:
     /** @defgroup Базовые операции
      *  В данной группе содержатся различные конструкторы, оператор присваивания, а так же методы
@@ -78,55 +838,81 @@ public:
      *  @{
      */
 
-    /** @brief Конструктор выделяет под матрицу размерами rows x cols область памяти, заполненную 0-ями
+    /** @brief Конструктор выделяет под матрицу размерами rows x cols область памяти, заполненную 0-ями.
+     *         Память выровнена по ALIGNMENT байт
      *  @param rows Колличество строк в матрице, считается по умолчанию, что он >= 0
      *  @param cols Колличество колонок в матрице, считается по умолчанию, что он >= 0
      * */
-    explicit Matrix(const size_t& _rows = 0, const size_t& _cols = 0) : rows(_rows), cols(_cols) {
-        matrix = new uint8_t[( rows * cols )];
-        for ( size_t i = 0, size = ( rows * cols ); i < size; ++i )
-		    matrix[i] = 0;
+    explicit Matrix(const size_t& _rows = 0, const size_t& _cols = 0) : rows(_rows), cols(_cols),
+            capacity( ( _rows * _cols ) ), matrix( allocate( capacity ) ) {
+        MatrixKernels::fill( matrix.get(), 0, ( rows * cols ) );
     }
 
     /** @brief Конструктор копирования
      *  @param rhs Другая матрица
      * */
-    Matrix(const Matrix& rhs) noexcept {
-        rows = rhs.getRows();
-        cols = rhs.getCols();
-	    matrix = new uint8_t[( rows * cols )];
-        for ( size_t i = 0; i < rows; ++i )
-		    for ( size_t j = 0; j < cols; ++j )
-                matrix[( j + ( i * cols ) )] = rhs.matrix[( j + ( i * cols ) )];
+    Matrix(const Matrix& rhs) : rows(rhs.rows), cols(rhs.cols), capacity( ( rhs.rows * rhs.cols ) ),
+            matrix( allocate( capacity ) ) {
+        MatrixKernels::copy( matrix.get(), rhs.matrix.get(), ( rows * cols ) );
     }
 
-    /** @brief Оператор присваивания
+    /** @brief Конструктор перемещения, забирает память rhs, rhs становится нулевой матрицей
+     *  @param rhs Другая матрица
+     * */
+    Matrix(Matrix&& rhs) noexcept : rows( std::exchange( rhs.rows, 0 ) ), cols( std::exchange( rhs.cols, 0 ) ),
+            capacity( std::exchange( rhs.capacity, 0 ) ), matrix( std::move( rhs.matrix ) ) {}
+
+    /** @brief Оператор присваивания. Если памяти хватает, она переиспользуется
      *  @param rhs Другая матрица
      *  @return Возвращает присвоенную матрицу
      * */
-    Matrix &operator=(const Matrix& rhs) noexcept {
+    Matrix &operator=(const Matrix& rhs) {
         if ( &rhs != this ) {
-            delete[] matrix;
-		    rows = rhs.getRows();
-            cols = rhs.getCols();
-            matrix = new uint8_t[( rows * cols )];
-		    for ( size_t i = 0; i < rows; ++i )
-                for ( size_t j = 0; j < cols; ++j )
-                    matrix[( j + ( i * cols ) )] = rhs.matrix[( j + ( i * cols ) )];
+            resize( rhs.rows, rhs.cols );
+            MatrixKernels::copy( matrix.get(), rhs.matrix.get(), ( rows * cols ) );
 	    }
         return *this;
     }
 
-    /** @brief Деструктор, должен очистить память
+    /** @brief Оператор перемещающего присваивания
+     *  @param rhs Другая матрица
+     *  @return Возвращает присвоенную матрицу
+     * */
+    Matrix &operator=(Matrix&& rhs) noexcept {
+        Matrix tmp( std::move( rhs ) );
+        swap( tmp );
+        return *this;
+    }
+
+    /** @brief Обменять содержимое без копирования
+     * */
+    void swap( Matrix& rhs ) noexcept {
+        std::swap( rows, rhs.rows );
+        std::swap( cols, rhs.cols );
+        std::swap( capacity, rhs.capacity );
+        std::swap( matrix, rhs.matrix );
+    }
+
+    /** @brief Изменить размер. Память перевыделяется, только если текущей не хватает,
+     *         содержимое после вызова не определено
      * */
-    ~Matrix() noexcept {
-        delete[] matrix;
+    void resize( const size_t& _rows, const size_t& _cols ) {
+        if( ( _rows * _cols ) > capacity ) {
+            matrix = allocate( ( _rows * _cols ) );
+            capacity = ( _rows * _cols );
+        }
+        rows = _rows;
+        cols = _cols;
     }
 
+    /** @brief Деструктор, память освобождается владеющим указателем
+     * */
+    ~Matrix() noexcept {}
+
     /** @brief Метод получения колличества строк
      *  @return Возвращает переменную rows
      * */
-    size_t getRows() const noexcept { return cols; }
+    size_t getRows() const noexcept { return rows; }
 
     /** @brief Метод получения колличества колонок
      *  @return Возвращает переменную cols
@@ -138,6 +924,15 @@ public:
 	 * */
     bool isNull() const noexcept { return ((cols == 0) || (rows == 0)); }
 
+    /** @brief Непосредственный доступ к элементам, строки подряд по cols элементов
+     * */
+    uint8_t* data() noexcept { return matrix.get(); }
+    const uint8_t* data() const noexcept { return matrix.get(); }
+
+    /** @brief Строка i без проверки границ
+     * */
+    Row row( const size_t& i ) const noexcept { return Row( ( matrix.get() + ( i * cols ) ), cols ); }
+
     /** @brief Спомощью такой перегруженной функциональные формы происходит
      *         извлечение элемента без его изменения.
      *  @param i номер строки, если не входит в границы, вернуть 0
@@ -178,11 +973,7 @@ public:
     bool operator==(const Matrix& rhs) const noexcept {
         if ( ( ( rows != rhs.rows ) || ( cols != rhs.cols ) ) )
             return false;
-	    for ( size_t i = 0; i < rows; ++i )
-            for ( size_t j = 0; j < cols; ++j )
-			    if ( std::abs( matrix[( j + ( i * cols ) )] - rhs.matrix[( j + ( i * cols ) )]) > 1e-7 )
-                    return false;
-        return true;
+        return MatrixKernels::equal( matrix.get(), rhs.matrix.get(), ( rows * cols ) );
     }
 
     /** @brief Булевая операци неравенства
@@ -205,21 +996,18 @@ public:
         FILE *f = fopen(fileName.c_str(),"rb");
         jpeg_stdio_src(&d1, f);
         jpeg_read_header(&d1, TRUE);
-        if( ( cols != 0 ) || ( rows != 0 ) )
-            delete[] matrix;
-        rows = d1.image_height;
-        cols = d1.image_width;
-        matrix = new uint8_t[( rows * cols )];
+        resize( d1.image_height, d1.image_width );
 
+        if( d1.num_components != 1 )
+            d1.out_color_space = JCS_RGB;
         jpeg_start_decompress(&d1);
-        uint8_t *pBuf = new uint8_t[rows * cols * d1.num_components]{};
+        uint8_t *pBuf = new uint8_t[cols * d1.output_components]{};
         for (size_t i = 0; d1.output_scanline < d1.output_height;) {
             i += jpeg_read_scanlines(&d1, (JSAMPARRAY)&(pBuf), 1);
-            for (size_t j = 0; j < cols; ++j) {
-                matrix[j + (i - 1) * cols] = get_grey(pBuf[j * d1.num_components + 2],
-                                                      pBuf[j * d1.num_components + 1],
-                                                      pBuf[j * d1.num_components + 0]);
-            }
+            if( d1.output_components == 1 )
+                MatrixKernels::copy( ( matrix.get() + ( i - 1 ) * cols ), pBuf, cols );
+            else
+                MatrixKernels::rgbToGrey( pBuf, ( matrix.get() + ( i - 1 ) * cols ), cols );
         }
 
         jpeg_finish_decompress(&d1);
@@ -228,102 +1016,838 @@ public:
         delete[] pBuf;
     }
 
-    void saveJpeg( const std::string& fileName ) {
-        struct jpeg_compress_struct cinfo;  /* Шаг 1: выделите и инициализируйте объект сжатия JPEG */
-        struct jpeg_error_mgr jerr;
-        JSAMPROW row_pointer[1];
-        cinfo.err = jpeg_std_error(&jerr);
-
-        jpeg_create_compress(&cinfo);  /* Шаг 2: укажите место назначения данных  (eg, a file) */
-        FILE *outfile = fopen( fileName.c_str(),"wb" );
-
-        jpeg_stdio_dest(&cinfo, outfile); /* Шаг 3: установите параметры для сжатия */
-        cinfo.image_width = cols;    /* Количество столбцов в изображении */
-        cinfo.image_height = rows;   /* Количество строк в изображении */
-        cinfo.input_components = 1;     // Каналы, RGB 3 ; GRAY 1
-        cinfo.in_color_space = J_COLOR_SPACE(1);
-        JSAMPLE* image_buffer = new JSAMPLE[cols * rows]();  /* Указывает на большой массив данных R, G, B-порядка */
-        for (size_t i = 0; i < cols * rows; ++i) {
-            image_buffer[i] = matrix[i];
-        }
-        jpeg_set_defaults(&cinfo);
-        jpeg_set_quality(&cinfo, 100, true);
-
-        jpeg_start_compress(&cinfo, true);  /* Шаг 4: Запустите компрессор */
-
-        while (cinfo.next_scanline < cinfo.image_height) {  /* Шаг 5: пока (строки сканирования еще предстоит записать)*/
-            row_pointer[0] = (JSAMPROW)&image_buffer[cinfo.next_scanline * cols];
-            (void)jpeg_write_scanlines(&cinfo, row_pointer, 1);
-        }
+    /** @brief Сохранить матрицу в файл JPEG в градациях серого
+     *  @param fileName Имя файла
+     *  @param quality Качество 1..100
+     *  @exception MatrixException() Файл не открылся или libjpeg сообщил об ошибке
+     * */
+    void saveJpeg( const std::string& fileName, const int& quality = 100 ) const;
 
-        jpeg_finish_compress(&cinfo);  /* Шаг 6: Завершите сжатие */
-        jpeg_destroy_compress(&cinfo);  /* Шаг 7: освободите объект сжатия JPEG */
-        fclose(outfile);
+    void drawLine( int x0, int y0, int x1, int y1, const uint8_t& color ) {
+        bresenhamLine( x0, y0, x1, y1, [this, &color]( const int& x, const int& y ) { set( x, y, color ); } );
     }
 
-    void drawLine( int x0, int y0, int x1, int y1, const uint8_t& color ) {
-        int A = ( y1 - y0 ), B = ( x0 - x1 );
-        int sign = ( ( std::abs(A) > std::abs(B) ) ? 1 : -1 );
-        int signa = ( ( A < 0 ) ? -1 : 1 ), signb = ( ( B < 0 ) ? -1 : 1 );
-        int f = 0;
-        matrix[(  x0 + ( y0 * cols )  )] = color;
-        int x = x0, y = y0;
-        if( sign == -1 ) {
-            do {
-                f += ( A * signa );
-                if( f > 0 ) {
-                    f -= ( B * signb );
-                    y += signa;
-                }
-                x -= signb;
-                matrix[( x + ( y * cols ) )] = color;
-            } while (x != x1 || y != y1);
-        } else {
-            do {
-                f += B * signb;
-                if( f > 0 ) {
-                    f -= A * signa;
-                    x -= signb;
-                }
-                y += signa;
-                matrix[( x + ( y * cols ) )] = color;
-            } while( ( x != x1 ) || ( y != y1 ) );
-        }
+    /** @brief Отрезок шириной 2 * radius точек со скругленными концами, см. capsuleLine()
+     * */
+    void drawCapsule( float x0, float y0, float x1, float y1, const float& radius, const uint8_t& color,
+            const bool& antialias = false ) {
+        capsuleLine( x0, y0, x1, y1, radius, antialias, 0, ( int(rows) - 1 ), cols,
+            [this, &color]( const int& y, const int& first, const int& last, const uint8_t& coverage ) {
+                uint8_t* line = ( matrix.get() + size_t(y) * cols + first );
+                const size_t n = ( last - first + 1 );
+                if( coverage == 255 )
+                    MatrixKernels::maximum( line, color, n );
+                else
+                    MatrixKernels::maximum( line, uint8_t( ( color * coverage + 127 ) / 255 ), n );
+            } );
     }
 
     void clear() {
-        for( size_t i = 0; i < ( rows * cols ); ++i )
-            matrix[i] = 0;
+        MatrixKernels::fill( matrix.get(), 0, ( rows * cols ) );
     }
 
     /** @} */ // Конец группы: Дополнительные операции над матрицами
 };
 
-OutOfRange::OutOfRange(size_t i, size_t j, const Matrix &matrix) : MatrixException(
+OutOfRange::OutOfRange(size_t i, size_t j, const Matrix &matrix) : OutOfRange(i, j, matrix.getRows(),
+    matrix.getCols()) {}
+
+OutOfRange::OutOfRange(size_t i, size_t j, size_t rows, size_t cols) : MatrixException(
     "Индексы (" + std::to_string(i) + ", " + std::to_string(j) +
     ") выход за границы матрицы. Размер матрицы [" +
-    std::to_string(matrix.getRows()) + ", " + std::to_string(matrix.getCols()) + "]"
+    std::to_string(rows) + ", " + std::to_string(cols) + "]"
 ) {}
 
-class CNCException : public std::exception {
-    std::string m_msg;
-public:
-    explicit CNCException(const std::string &msg) : m_msg(msg) {}
-    const char *what() const noexcept override { return m_msg.c_str(); }
+/** @brief Прямоугольная область матрицы
+ * */
+struct Region {
+    size_t row = 0;
+    size_t col = 0;
+    size_t rows = 0;
+    size_t cols = 0;
+
+    bool empty() const noexcept { return ( ( rows == 0 ) || ( cols == 0 ) ); }
 };
 
-class UnknownGCode : public CNCException {
-    std::string m_msg;
-public:
-    explicit UnknownGCode( const std::string &code ) : CNCException( "Неизвестный код!: " + code ) {}
+/** @brief Отрезки слоя в виде структуры массивов: рисование откладывается до сохранения слоя,
+ *         чтобы растеризовать слой полосами в несколько потоков.
+ *         width - ширина капсулы в точках, 0 - линия Брезенхэма
+ * */
+struct SegmentBuffer {
+    std::vector<float> x0;
+    std::vector<float> y0;
+    std::vector<float> x1;
+    std::vector<float> y1;
+    std::vector<float> width;
+
+    size_t size() const noexcept { return x0.size(); }
+    bool empty() const noexcept { return x0.empty(); }
+
+    void push( const float& ax, const float& ay, const float& bx, const float& by, const float& w ) {
+        x0.push_back( ax );
+        y0.push_back( ay );
+        x1.push_back( bx );
+        y1.push_back( by );
+        width.push_back( w );
+    }
+
+    /** @brief Очистить, сохранив выделенную память для следующего слоя
+     * */
+    void clear() noexcept {
+        x0.clear();
+        y0.clear();
+        x1.clear();
+        y1.clear();
+        width.clear();
+    }
 };
 
-class FileNotOpen : public std::exception {
-    std::string m_msg;
+/* @class TiledMatrix разреженная матрица слоя с тем же набором операций, что и Matrix.
+ *        Память выделяется плитками TILE x TILE при первой записи в плитку, записанные плитки
+ *        запоминаются, поэтому clear() обнуляет только их, а экспорт может обрезать слой по
+ *        границам записанных плиток. Выделенные плитки после clear() не освобождаются и
+ *        переиспользуются следующим слоем
+ * @param rows Строки
+ * @param cols Колонки
+ * */
+class TiledMatrix {
 public:
-    explicit FileNotOpen(const std::string &msg) : m_msg(msg) {}
-    const char *what() const noexcept override { return m_msg.c_str(); }
-};
+    static constexpr size_t TILE_SHIFT = 6;
+    static constexpr size_t TILE = ( size_t(1) << TILE_SHIFT );
+
+private:
+    size_t rows;
+    size_t cols;
+    size_t tileRows;
+    size_t tileCols;
+    std::vector<std::unique_ptr<uint8_t[]>> tiles;
+    std::vector<uint8_t> dirty;
+    std::vector<uint32_t> dirtyTiles;
+
+    /** @param touched Куда добавить плитку, если она записывается впервые
+     * */
+    uint8_t* touch( const size_t& i, const size_t& j, std::vector<uint32_t>& touched ) {
+        const size_t t = ( ( i >> TILE_SHIFT ) * tileCols + ( j >> TILE_SHIFT ) );
+        if( !dirty[t] ) {
+            if( !tiles[t] )
+                tiles[t] = std::make_unique<uint8_t[]>( TILE * TILE );
+            dirty[t] = 1;
+            touched.push_back( t );
+        }
+        return ( tiles[t].get() + ( ( ( i & ( TILE - 1 ) ) << TILE_SHIFT ) + ( j & ( TILE - 1 ) ) ) );
+    }
+
+    /** @brief Наложить value по максимуму на точки first..last строки y, отрезок делится по плиткам
+     * */
+    void span( const size_t& y, size_t first, const size_t& last, const uint8_t& value,
+            std::vector<uint32_t>& touched ) {
+        while( first <= last ) {
+            const size_t n = std::min( ( TILE - ( first & ( TILE - 1 ) ) ), ( last - first + 1 ) );
+            MatrixKernels::maximum( touch( y, first, touched ), value, n );
+            first += n;
+        }
+    }
+
+public:
+    explicit TiledMatrix( const size_t& _rows = 0, const size_t& _cols = 0 ) : rows(_rows), cols(_cols),
+            tileRows( ( ( _rows + TILE - 1 ) >> TILE_SHIFT ) ), tileCols( ( ( _cols + TILE - 1 ) >> TILE_SHIFT ) ),
+            tiles( ( tileRows * tileCols ) ), dirty( ( tileRows * tileCols ), 0 ) {}
+
+    size_t getRows() const noexcept { return rows; }
+    size_t getCols() const noexcept { return cols; }
+    bool isNull() const noexcept { return ((cols == 0) || (rows == 0)); }
+
+    /** @brief Количество плиток, выделенных за все время жизни матрицы
+     * */
+    size_t allocatedTiles() const noexcept {
+        size_t count = 0;
+        for( const auto& tile : tiles )
+            count += ( tile != nullptr );
+        return count;
+    }
+
+    /** @brief Извлечение элемента без изменения. Незаписанные плитки читаются как 0
+     *  @exception OutOfRange() Выход за пределы матрицы
+     * */
+    uint8_t operator()(size_t i, size_t j) const {
+        if( ( ( i >= rows ) || ( j >= cols ) ) )
+            throw OutOfRange( i, j, rows, cols );
+        const size_t t = ( ( i >> TILE_SHIFT ) * tileCols + ( j >> TILE_SHIFT ) );
+        if( !dirty[t] )
+            return 0;
+        return tiles[t][( ( ( i & ( TILE - 1 ) ) << TILE_SHIFT ) + ( j & ( TILE - 1 ) ) )];
+    }
+
+    /** @brief Извлечение элемента для изменения, плитка выделяется при необходимости
+     *  @exception OutOfRange() Выход за пределы матрицы
+     * */
+    uint8_t& operator()(size_t i, size_t j) {
+        if( ( ( i >= rows ) || ( j >= cols ) ) )
+            throw OutOfRange( i, j, rows, cols );
+        return *touch( i, j, dirtyTiles );
+    }
+
+    /** @brief Записать точку, если она лежит в пределах матрицы
+     * */
+    inline void set( const int& x, const int& y, const uint8_t& color ) {
+        if( ( x >= 0 ) && ( y >= 0 ) && ( size_t(x) < cols ) && ( size_t(y) < rows ) )
+            *touch( y, x, dirtyTiles ) = color;
+    }
+
+    void drawLine( int x0, int y0, int x1, int y1, const uint8_t& color ) {
+        bresenhamLine( x0, y0, x1, y1, [this, &color]( const int& x, const int& y ) { set( x, y, color ); } );
+    }
+
+    /** @brief Отрезок шириной 2 * radius точек со скругленными концами, см. capsuleLine().
+     *         Отрезки строк делятся по границам плиток
+     * */
+    void drawCapsule( float x0, float y0, float x1, float y1, const float& radius, const uint8_t& color,
+            const bool& antialias = false ) {
+        capsuleLine( x0, y0, x1, y1, radius, antialias, 0, ( int(rows) - 1 ), cols,
+            [this, &color]( const int& y, const int& first, const int& last, const uint8_t& coverage ) {
+                span( y, first, last, ( ( coverage == 255 ) ? color : uint8_t( ( color * coverage + 127 ) / 255 ) ),
+                    dirtyTiles );
+            } );
+    }
+
+    /** @brief Нарисовать отрезки буфера, разбив матрицу на горизонтальные полосы из целых строк плиток.
+     *         Отрезки заранее раскладываются по полосам, которые они задевают, и каждая полоса рисуется
+     *         своим потоком без блокировок: плитки полос не пересекаются, а новые записанные плитки
+     *         собираются в список полосы и добавляются к dirtyTiles после завершения потоков.
+     *         Все точки рисуются одним цветом с наложением по максимуму, поэтому результат не зависит
+     *         от порядка и совпадает с последовательным рисованием
+     *  @param threads Потоков рисования, 1 - в текущем потоке
+     * */
+    void drawSegments( const SegmentBuffer& segments, const uint8_t& color, const bool& antialias,
+            const size_t& threads ) {
+        if( segments.empty() || isNull() )
+            return;
+        const size_t bands = std::min( tileRows, ( std::max<size_t>( threads, 1 ) * 4 ) );
+        const size_t bandTiles = ( ( tileRows + bands - 1 ) / bands );
+        const size_t bandRows = ( bandTiles << TILE_SHIFT );
+        std::vector<std::vector<uint32_t>> bins( ( ( tileRows + bandTiles - 1 ) / bandTiles ) );
+        for( size_t k = 0; k < segments.size(); ++k ) {
+            const float reach = ( ( segments.width[k] / 2 ) + 1 );
+            const float top = ( std::min( segments.y0[k], segments.y1[k] ) - reach );
+            const float bottom = ( std::max( segments.y0[k], segments.y1[k] ) + reach );
+            if( ( bottom < 0 ) || ( top >= float(rows) ) )
+                continue;
+            const size_t first = ( size_t( std::max( top, 0.0f ) ) / bandRows );
+            const size_t last = std::min( ( bins.size() - 1 ), ( size_t( bottom ) / bandRows ) );
+            for( size_t b = first; b <= last; ++b )
+                bins[b].push_back( k );
+        }
+
+        std::vector<std::vector<uint32_t>> touched( bins.size() );
+        const auto drawBand = [&]( const size_t& b ) {
+            const int top = int( b * bandRows );
+            const int bottom = int( std::min( ( ( b + 1 ) * bandRows ), rows ) - 1 );
+            std::vector<uint32_t>& list = touched[b];
+            uint64_t pixels = 0;
+            for( const uint32_t& k : bins[b] ) {
+                if( segments.width[k] == 0 ) {
+                    bresenhamLine( int( segments.x0[k] ), int( segments.y0[k] ), int( segments.x1[k] ),
+                        int( segments.y1[k] ), std::max( top, 0 ), bottom, [&]( const int& x, const int& y ) {
+                            if( ( x >= 0 ) && ( size_t(x) < cols ) ) {
+                                *touch( y, x, list ) = color;
+                                ++pixels;
+                            }
+                        } );
+                    continue;
+                }
+                capsuleLine( segments.x0[k], segments.y0[k], segments.x1[k], segments.y1[k], ( segments.width[k] / 2 ),
+                    antialias, top, bottom, cols,
+                    [&]( const int& y, const int& first, const int& last, const uint8_t& coverage ) {
+                        span( y, first, last, ( ( coverage == 255 ) ? color :
+                            uint8_t( ( color * coverage + 127 ) / 255 ) ), list );
+                        pixels += uint64_t( last - first + 1 );
+                    } );
+            }
+            PROFILE_COUNT( PIXELS, pixels );
+        };
+        if( threads <= 1 ) {
+            for( size_t b = 0; b < bins.size(); ++b )
+                drawBand( b );
+        } else {
+            std::atomic<size_t> next( 0 );
+            const auto work = [&]() {
+                for( size_t b = next++; b < bins.size(); b = next++ )
+                    drawBand( b );
+            };
+            std::vector<std::thread> pool;
+            for( size_t i = 1; i < std::min( threads, bins.size() ); ++i )
+                pool.emplace_back( work );
+            work();
+            for( auto& thread : pool )
+                thread.join();
+        }
+        for( const auto& list : touched )
+            dirtyTiles.insert( dirtyTiles.end(), list.begin(), list.end() );
+    }
+
+    /** @brief Обнулить только записанные плитки
+     * */
+    void clear() {
+        for( const uint32_t& t : dirtyTiles ) {
+            MatrixKernels::fill( tiles[t].get(), 0, ( TILE * TILE ) );
+            dirty[t] = 0;
+        }
+        dirtyTiles.clear();
+    }
+
+    /** @brief Границы записанных плиток, обрезанные по размеру матрицы
+     *  @return Пустая область, если в слой ничего не записывали
+     * */
+    Region bounds() const noexcept {
+        if( dirtyTiles.empty() )
+            return Region();
+        size_t r0 = tileRows, c0 = tileCols, r1 = 0, c1 = 0;
+        for( const uint32_t& t : dirtyTiles ) {
+            r0 = std::min( r0, ( t / tileCols ) );
+            r1 = std::max( r1, ( t / tileCols ) );
+            c0 = std::min( c0, ( t % tileCols ) );
+            c1 = std::max( c1, ( t % tileCols ) );
+        }
+        Region r;
+        r.row = ( r0 << TILE_SHIFT );
+        r.col = ( c0 << TILE_SHIFT );
+        r.rows = ( std::min( ( ( r1 + 1 ) << TILE_SHIFT ), rows ) - r.row );
+        r.cols = ( std::min( ( ( c1 + 1 ) << TILE_SHIFT ), cols ) - r.col );
+        return r;
+    }
+
+    /** @brief Точные границы ненулевых точек внутри записанных плиток
+     *  @return Пустая область, если ненулевых точек нет
+     * */
+    Region extents() const noexcept {
+        size_t r0 = rows, c0 = cols, r1 = 0, c1 = 0;
+        for( const uint32_t& t : dirtyTiles ) {
+            const uint8_t* tile = tiles[t].get();
+            const size_t row = ( ( t / tileCols ) << TILE_SHIFT ), col = ( ( t % tileCols ) << TILE_SHIFT );
+            for( size_t i = 0, first = 0, last = 0; i < TILE; ++i )
+                if( MatrixKernels::extent( ( tile + ( i << TILE_SHIFT ) ), TILE, first, last ) ) {
+                    r0 = std::min( r0, ( row + i ) );
+                    r1 = std::max( r1, ( row + i ) );
+                    c0 = std::min( c0, ( col + first ) );
+                    c1 = std::max( c1, ( col + last ) );
+                }
+        }
+        if( r0 > r1 )
+            return Region();
+        Region r;
+        r.row = r0;
+        r.col = c0;
+        r.rows = ( r1 - r0 + 1 );
+        r.cols = ( c1 - c0 + 1 );
+        return r;
+    }
+
+    /** @brief Скопировать область в плотную матрицу размером region.rows x region.cols
+     *  @param out Матрица-приемник: получает размер области, ее буфер переиспользуется и перевыделяется,
+     *             только если его емкости не хватает. Каждая точка области перезаписывается
+     * */
+    void exportTo( Matrix& out, const Region& region ) const {
+        out.resize( region.rows, region.cols );
+        uint8_t* dst = out.data();
+        for( size_t i = 0; i < region.rows; ++i ) {
+            const size_t row = ( region.row + i );
+            for( size_t j = 0; j < region.cols; ) {
+                const size_t col = ( region.col + j );
+                const size_t t = ( ( row >> TILE_SHIFT ) * tileCols + ( col >> TILE_SHIFT ) );
+                const size_t n = std::min( ( TILE - ( col & ( TILE - 1 ) ) ), ( region.cols - j ) );
+                uint8_t* line = ( dst + ( i * region.cols ) + j );
+                if( dirty[t] )
+                    MatrixKernels::copy( line, ( tiles[t].get() + ( ( row & ( TILE - 1 ) ) << TILE_SHIFT ) +
+                        ( col & ( TILE - 1 ) ) ), n );
+                else
+                    MatrixKernels::fill( line, 0, n );
+                j += n;
+            }
+        }
+    }
+
+    /** @brief Скопировать всю матрицу в плотную
+     * */
+    void exportTo( Matrix& out ) const {
+        Region all;
+        all.rows = rows;
+        all.cols = cols;
+        exportTo( out, all );
+    }
+};
+
+/** @brief Уменьшить src в factor раз по каждой стороне фильтром максимума: точка результата - самая яркая
+ *         точка своего квадрата factor x factor, поэтому линии толщиной в точку не пропадают. Строки квадрата
+ *         сначала складываются maximum() в row, затем row сжимается reduceMax()
+ *  @param row Рабочий буфер строки, переиспользуется между вызовами
+ * */
+inline void downsampleMax( const Matrix& src, const size_t& factor, Matrix& dst, std::vector<uint8_t>& row ) {
+    const size_t rows = src.getRows(), cols = src.getCols();
+    dst.resize( ( ( rows + factor - 1 ) / factor ), ( ( cols + factor - 1 ) / factor ) );
+    row.resize( cols );
+    for( size_t i = 0; i < dst.getRows(); ++i ) {
+        const size_t first = ( i * factor );
+        MatrixKernels::copy( row.data(), ( src.data() + first * cols ), cols );
+        for( size_t r = ( first + 1 ); r < std::min( ( first + factor ), rows ); ++r )
+            MatrixKernels::maximum( row.data(), ( src.data() + r * cols ), cols );
+        MatrixKernels::reduceMax( row.data(), cols, factor, ( dst.data() + i * dst.getCols() ) );
+    }
+}
+
+/** @brief Кодировщик слоя в формат изображения. Результат пишется в переиспользуемый буфер в памяти,
+ *         поэтому один экземпляр кодирует слои подряд без лишних выделений. Экземпляр не потокобезопасен
+ * */
+class LayerEncoder {
+public:
+    virtual ~LayerEncoder() {}
+
+    /** @brief Расширение файла без точки
+     * */
+    virtual const char* extension() const noexcept = 0;
+
+    /** @brief Закодировать изображение
+     *  @param out Буфер результата, прежнее содержимое заменяется
+     *  @exception MatrixException() Ошибка кодирования
+     * */
+    virtual void encode( const Matrix& image, std::vector<uint8_t>& out ) = 0;
+};
+
+/** @brief JPEG через libjpeg(-turbo) с назначением в std::vector. Быстрое целочисленное DCT (JDCT_IFAST)
+ *         в libjpeg-turbo векторизовано и заметно быстрее точного, но хуже на высоком качестве
+ * */
+class JpegEncoder : public LayerEncoder {
+    struct VectorDestination {
+        struct jpeg_destination_mgr pub;
+        std::vector<uint8_t>* out;
+
+        static void init( j_compress_ptr cinfo ) {
+            VectorDestination* dest = reinterpret_cast<VectorDestination*>( cinfo->dest );
+            dest->out->resize( std::max<size_t>( dest->out->capacity(), ( 1 << 16 ) ) );
+            dest->pub.next_output_byte = dest->out->data();
+            dest->pub.free_in_buffer = dest->out->size();
+        }
+
+        static boolean grow( j_compress_ptr cinfo ) {
+            VectorDestination* dest = reinterpret_cast<VectorDestination*>( cinfo->dest );
+            const size_t used = dest->out->size();
+            dest->out->resize( ( 2 * used ) );
+            dest->pub.next_output_byte = ( dest->out->data() + used );
+            dest->pub.free_in_buffer = ( dest->out->size() - used );
+            return TRUE;
+        }
+
+        static void term( j_compress_ptr cinfo ) {
+            VectorDestination* dest = reinterpret_cast<VectorDestination*>( cinfo->dest );
+            dest->out->resize( ( dest->out->size() - dest->pub.free_in_buffer ) );
+        }
+    };
+
+    int quality;
+    bool fastDct;
+
+public:
+    explicit JpegEncoder( const int& quality = 100, const bool& fastDct = false ) :
+        quality( std::clamp( quality, 1, 100 ) ), fastDct(fastDct) {}
+
+    const char* extension() const noexcept override { return "jpg"; }
+
+    void encode( const Matrix& image, std::vector<uint8_t>& out ) override {
+        struct jpeg_compress_struct cinfo;  /* Шаг 1: выделите и инициализируйте объект сжатия JPEG */
+        struct JpegError jerr;
+        VectorDestination dest;
+        JSAMPROW row_pointer[1];
+        cinfo.err = jpeg_std_error(&jerr.pub);
+        jerr.pub.error_exit = JpegError::exit;
+        if( setjmp( jerr.jump ) ) {
+            jpeg_destroy_compress(&cinfo);
+            throw MatrixException( std::string( "Ошибка libjpeg: " ) + jerr.message );
+        }
+
+        jpeg_create_compress(&cinfo);  /* Шаг 2: укажите место назначения данных */
+        dest.pub.init_destination = VectorDestination::init;
+        dest.pub.empty_output_buffer = VectorDestination::grow;
+        dest.pub.term_destination = VectorDestination::term;
+        dest.out = &out;
+        cinfo.dest = &dest.pub;
+        cinfo.image_width = image.getCols();  /* Шаг 3: установите параметры для сжатия */
+        cinfo.image_height = image.getRows();
+        cinfo.input_components = 1;     // Каналы, RGB 3 ; GRAY 1
+        cinfo.in_color_space = JCS_GRAYSCALE;
+        jpeg_set_defaults(&cinfo);
+        jpeg_set_quality(&cinfo, quality, true);
+        if( fastDct )
+            cinfo.dct_method = JDCT_IFAST;
+
+        jpeg_start_compress(&cinfo, true);  /* Шаг 4: Запустите компрессор */
+        while (cinfo.next_scanline < cinfo.image_height) {  /* Шаг 5: пока (строки сканирования еще предстоит записать)*/
+            row_pointer[0] = const_cast<JSAMPROW>( image.row( cinfo.next_scanline ).data() );  // libjpeg строку не меняет
+            (void)jpeg_write_scanlines(&cinfo, row_pointer, 1);
+        }
+        jpeg_finish_compress(&cinfo);  /* Шаг 6: Завершите сжатие */
+        jpeg_destroy_compress(&cinfo);  /* Шаг 7: освободите объект сжатия JPEG */
+    }
+};
+
+/** @brief QOI (https://qoiformat.org), оттенок серого пишется как RGB с равными каналами.
+ *         Длинные серии одинаковых точек сжимаются в QOI_OP_RUN, что для масок траектории почти все
+ * */
+class QoiEncoder : public LayerEncoder {
+    static void put32( std::vector<uint8_t>& out, const uint32_t& v ) {
+        out.push_back( uint8_t( v >> 24 ) );
+        out.push_back( uint8_t( v >> 16 ) );
+        out.push_back( uint8_t( v >> 8 ) );
+        out.push_back( uint8_t( v ) );
+    }
+
+public:
+    const char* extension() const noexcept override { return "qoi"; }
+
+    void encode( const Matrix& image, std::vector<uint8_t>& out ) override {
+        out.clear();
+        out.insert( out.end(), { 'q', 'o', 'i', 'f' } );
+        put32( out, image.getCols() );
+        put32( out, image.getRows() );
+        out.push_back( 3 );  // RGB
+        out.push_back( 0 );  // sRGB
+        std::array<int, 64> index;
+        index.fill( -1 );
+        int prev = 0, run = 0;
+        const size_t size = ( image.getRows() * image.getCols() );
+        const uint8_t* px = image.data();
+        for( size_t i = 0; i < size; ++i ) {
+            const int v = px[i];
+            if( v == prev ) {
+                if( ( ++run == 62 ) || ( ( i + 1 ) == size ) ) {
+                    out.push_back( uint8_t( 0xC0 | ( run - 1 ) ) );
+                    run = 0;
+                }
+                continue;
+            }
+            if( run > 0 ) {
+                out.push_back( uint8_t( 0xC0 | ( run - 1 ) ) );
+                run = 0;
+            }
+            const int hash = ( ( v * 3 + v * 5 + v * 7 + 255 * 11 ) % 64 );
+            const int d = int( int8_t( uint8_t( v - prev ) ) );
+            if( index[hash] == v )
+                out.push_back( uint8_t( hash ) );
+            else if( ( d >= -2 ) && ( d <= 1 ) )
+                out.push_back( uint8_t( 0x40 | ( ( d + 2 ) << 4 ) | ( ( d + 2 ) << 2 ) | ( d + 2 ) ) );
+            else if( ( d >= -32 ) && ( d <= 31 ) ) {
+                out.push_back( uint8_t( 0x80 | ( d + 32 ) ) );
+                out.push_back( 0x88 );
+            } else
+                out.insert( out.end(), { 0xFE, uint8_t( v ), uint8_t( v ), uint8_t( v ) } );
+            index[hash] = v;
+            prev = v;
+        }
+        out.insert( out.end(), { 0, 0, 0, 0, 0, 0, 0, 1 } );
+    }
+};
+
+/** @brief PBM (P4): 1 бит на точку, точки ярче 127 считаются траекторией и пишутся белыми (бит 0)
+ * */
+class PbmEncoder : public LayerEncoder {
+public:
+    const char* extension() const noexcept override { return "pbm"; }
+
+    void encode( const Matrix& image, std::vector<uint8_t>& out ) override {
+        const std::string header = ( "P4\n" + std::to_string( image.getCols() ) + " " +
+            std::to_string( image.getRows() ) + "\n" );
+        const size_t stride = ( ( image.getCols() + 7 ) / 8 );
+        out.assign( header.begin(), header.end() );
+        out.resize( ( header.size() + stride * image.getRows() ), 0 );
+        uint8_t* dst = ( out.data() + header.size() );
+        for( size_t i = 0; i < image.getRows(); ++i, dst += stride ) {
+            const Matrix::Row row = image.row( i );
+            for( size_t j = 0; j < row.size(); ++j )
+                dst[( j >> 3 )] |= uint8_t( ( row[j] < 128 ) << ( 7 - ( j & 7 ) ) );
+        }
+    }
+};
+
+/** @brief PGM (P5): байт на точку без сжатия
+ * */
+class PgmEncoder : public LayerEncoder {
+public:
+    const char* extension() const noexcept override { return "pgm"; }
+
+    void encode( const Matrix& image, std::vector<uint8_t>& out ) override {
+        const std::string header = ( "P5\n" + std::to_string( image.getCols() ) + " " +
+            std::to_string( image.getRows() ) + "\n255\n" );
+        out.assign( header.begin(), header.end() );
+        out.resize( ( header.size() + image.getRows() * image.getCols() ) );
+        MatrixKernels::copy( ( out.data() + header.size() ), image.data(), ( image.getRows() * image.getCols() ) );
+    }
+};
+
+enum class LayerFormat {
+    JPEG,
+    QOI,
+    PBM,
+    PGM
+};
+
+struct EncoderOptions {
+    LayerFormat format = LayerFormat::JPEG;
+    int quality = 100;     // только для JPEG
+    bool fastDct = false;  // только для JPEG: JDCT_IFAST
+};
+
+inline std::unique_ptr<LayerEncoder> makeEncoder( const EncoderOptions& options ) {
+    switch( options.format ) {
+        case LayerFormat::QOI:
+            return std::make_unique<QoiEncoder>();
+        case LayerFormat::PBM:
+            return std::make_unique<PbmEncoder>();
+        case LayerFormat::PGM:
+            return std::make_unique<PgmEncoder>();
+        default:
+            return std::make_unique<JpegEncoder>( options.quality, options.fastDct );
+    }
+}
+
+/** @brief Записать буфер в файл целиком
+ *  @exception MatrixException() Файл не открылся или запись не удалась
+ * */
+inline void writeFile( const std::string& fileName, const std::vector<uint8_t>& bytes ) {
+    FILE *outfile = fopen( fileName.c_str(), "wb" );
+    if( outfile == nullptr )
+        throw MatrixException( "Не удалось открыть файл: " + fileName );
+    const size_t written = fwrite( bytes.data(), 1, bytes.size(), outfile );
+    if( ( fclose(outfile) != 0 ) || ( written != bytes.size() ) )
+        throw MatrixException( "Ошибка записи файла: " + fileName );
+}
+
+void Matrix::saveJpeg( const std::string& fileName, const int& quality ) const {
+    std::vector<uint8_t> bytes;
+    JpegEncoder( quality ).encode( *this, bytes );
+    writeFile( fileName, bytes );
+}
+
+class CNCException : public std::exception {
+    std::string m_msg;
+public:
+    explicit CNCException(const std::string &msg) : m_msg(msg) {}
+    const char *what() const noexcept override { return m_msg.c_str(); }
+};
+
+class UnknownGCode : public CNCException {
+    std::string m_msg;
+public:
+    explicit UnknownGCode( const std::string &code ) : CNCException( "Неизвестный код!: " + code ) {}
+};
+
+class TooManyWords : public CNCException {
+public:
+    explicit TooManyWords( const std::string_view &line ) : CNCException( "Слишком много слов в строке!: " +
+        std::string( line ) ) {}
+};
+
+class FileNotOpen : public std::exception {
+    std::string m_msg;
+public:
+    explicit FileNotOpen(const std::string &msg) : m_msg(msg) {}
+    const char *what() const noexcept override { return m_msg.c_str(); }
+};
+
+// Знаков после запятой в координатах с фиксированной точкой: слайсеры пишут E с точностью 0.00001 мм
+#ifndef FIXED_DIGITS
+#define FIXED_DIGITS 5
+#endif
+
+/** @brief Координата с фиксированной точкой: целое число единиц 10^-FIXED_DIGITS мм
+ * */
+using Fixed = int64_t;
+
+constexpr Fixed pow10Fixed( const int& digits ) noexcept {
+    return ( ( digits <= 0 ) ? 1 : ( 10 * pow10Fixed( digits - 1 ) ) );
+}
+
+constexpr Fixed FIXED_SCALE = pow10Fixed( FIXED_DIGITS );  // единиц в мм
+static_assert( ( FIXED_DIGITS >= 1 ) && ( FIXED_DIGITS <= 9 ), "FIXED_DIGITS должен быть от 1 до 9" );
+
+/** @brief Перевести v в единицы scale на мм, округляя половину от нуля
+ * */
+constexpr Fixed fixedTo( const Fixed& v, const Fixed& scale ) noexcept {
+    if( scale >= FIXED_SCALE )
+        return ( v * ( scale / FIXED_SCALE ) );
+    const Fixed divisor = ( FIXED_SCALE / scale );
+    return ( ( v >= 0 ) ? ( ( v + divisor / 2 ) / divisor ) : -( ( -v + divisor / 2 ) / divisor ) );
+}
+
+/** @brief [+-]цифры[.цифры] в единицах FIXED_SCALE, лишние знаки после запятой округляются
+ *  @param exact Число помещается в Fixed без округления
+ *  @return false, если текст не такого вида (экспонента, мусор, слишком длинная целая часть)
+ * */
+inline bool parseFixed( const char* first, const char* last, Fixed& value, bool& exact ) noexcept {
+    const bool negative = ( ( first != last ) && ( *first == '-' ) );
+    if( ( first != last ) && ( ( *first == '-' ) || ( *first == '+' ) ) )
+        ++first;
+    Fixed whole = 0;
+    int digits = 0;
+    for( ; ( first != last ) && ( *first >= '0' ) && ( *first <= '9' ); ++first, ++digits )
+        whole = ( whole * 10 + ( *first - '0' ) );
+    Fixed fraction = 0;
+    int fractionDigits = 0;
+    bool roundUp = false;
+    exact = true;
+    if( ( first != last ) && ( *first == '.' ) ) {
+        for( ++first; ( first != last ) && ( *first >= '0' ) && ( *first <= '9' ); ++first, ++digits ) {
+            if( fractionDigits < FIXED_DIGITS ) {
+                fraction = ( fraction * 10 + ( *first - '0' ) );
+                ++fractionDigits;
+            } else {
+                if( fractionDigits++ == FIXED_DIGITS )
+                    roundUp = ( *first >= '5' );
+                exact = ( exact && ( *first == '0' ) );
+            }
+        }
+    }
+    const int kept = std::min( fractionDigits, FIXED_DIGITS );
+    if( ( first != last ) || ( digits == 0 ) || ( ( digits - fractionDigits ) > 12 ) )
+        return false;
+    value = ( whole * FIXED_SCALE + fraction * pow10Fixed( FIXED_DIGITS - kept ) + ( roundUp ? 1 : 0 ) );
+    if( negative )
+        value = -value;
+    return true;
+}
+
+/** @brief Перевести float в Fixed через кратчайшую десятичную запись, которая дает тот же float: так из
+ *         значения, разобранного из текста, получается то же Fixed, что и из самого текста
+ * */
+inline Fixed toFixed( const float& v ) noexcept {
+    char text[32];
+    const std::to_chars_result res = std::to_chars( text, ( text + sizeof(text) ), v );
+    Fixed value;
+    bool exact;
+    if( ( res.ec == std::errc() ) && parseFixed( text, res.ptr, value, exact ) )
+        return value;
+    return std::llround( std::clamp( ( double( v ) * FIXED_SCALE ), -9e15, 9e15 ) );
+}
+
+inline float fixedToFloat( const Fixed& v ) noexcept {
+    return float( double( v ) / FIXED_SCALE );
+}
+
+/** @brief Слово G-code: буква, значение и то же значение с фиксированной точкой
+ * */
+struct GCodeWord {
+    char first;
+    float second;
+    Fixed fixed;
+
+    GCodeWord() : first(0), second(0), fixed(0) {}
+    GCodeWord( const char& letter, const float& value ) : first(letter), second(value), fixed( toFixed( value ) ) {}
+    GCodeWord( const char& letter, const float& value, const Fixed& fixed ) : first(letter), second(value),
+        fixed(fixed) {}
+};
+
+/** @brief Разбор строки G-code без выделения памяти. Команда и слова хранятся как string_view на исходную
+ *         строку и массив слов (буква, значение) фиксированной емкости на стеке. Десятичное число
+ *         переводится в Fixed прямо из текста, float получается из него; экспонента и больше
+ *         FIXED_DIGITS знаков после запятой разбираются from_chars.
+ *         Слово без числа (например "X" в "M84 X Y E") получает значение std::numeric_limits<float>::min()
+ * */
+class GCodeLine {
+public:
+    using cfp = GCodeWord;
+    static constexpr size_t CAPACITY = 32;
+
+private:
+    std::string_view cmd;
+    std::array<cfp, CAPACITY> pairs;
+    size_t count;
+
+    static constexpr bool isSpace( const char& c ) noexcept {
+        return ( ( c == ' ' ) || ( c == '\t' ) || ( c == '\r' ) || ( c == '\n' ) );
+    }
+
+    static float getValue( const char* first, const char* last ) noexcept {
+        if( ( first != last ) && ( *first == '+' ) )
+            ++first;
+        float value = std::numeric_limits<float>::min();
+        if( std::from_chars( first, last, value ).ec != std::errc() )
+            return std::numeric_limits<float>::min();
+        return value;
+    }
+
+
+public:
+    GCodeLine() : count(0) {}
+
+    /** @brief Разбирает строку: отбрасывает комментарий после ';', делит по пробелам/табуляции
+     *  @param line Строка без символа перевода строки. Должна жить, пока используется command()
+     *  @return false, если после удаления комментария строка пустая
+     *  @exception TooManyWords() В строке больше CAPACITY слов
+     * */
+    bool parse( std::string_view line ) {
+        count = 0;
+        cmd = std::string_view();
+        line = line.substr( 0, line.find( ';' ) );
+        const char* it = line.data();
+        const char* end = ( it + line.size() );
+        while( it != end ) {
+            while( ( it != end ) && isSpace( *it ) )
+                ++it;
+            if( it == end )
+                break;
+            const char* begin = it;
+            while( ( it != end ) && !isSpace( *it ) )
+                ++it;
+            if( cmd.empty() ) {
+                cmd = std::string_view( begin, ( it - begin ) );
+                continue;
+            }
+            if( count == CAPACITY )
+                throw TooManyWords( line );
+            Fixed fixed;
+            bool exact;
+            if( parseFixed( ( begin + 1 ), it, fixed, exact ) )
+                pairs[count++] = cfp( *begin, ( exact ? fixedToFloat( fixed ) : getValue( ( begin + 1 ), it ) ), fixed );
+            else
+                pairs[count++] = cfp( *begin, getValue( ( begin + 1 ), it ) );
+        }
+        return !cmd.empty();
+    }
+
+    std::string_view command() const noexcept { return cmd; }
+    const cfp* data() const noexcept { return pairs.data(); }
+    size_t size() const noexcept { return count; }
+};
+
+/** @brief Код команды G-code: буква в старших 16 битах, номер в младших ("G1" -> 'G' << 16 | 1).
+ *         0 означает, что команду не удалось разобрать
+ * */
+using Opcode = uint32_t;
+
+constexpr Opcode makeOpcode( const char& letter, const uint32_t& number ) noexcept {
+    return ( ( Opcode( uint8_t( letter ) ) << 16 ) | number );
+}
+
+/** @brief Переводит текст команды ("G1", "M104", "g28") в код. Номер должен быть целым и меньше 65536
+ *  @return Код команды или 0, если текст не является командой
+ * */
+constexpr Opcode decodeOpcode( const std::string_view& cmd ) noexcept {
+    if( ( cmd.size() < 2 ) || ( cmd.size() > 6 ) )
+        return 0;
+    char letter = cmd[0];
+    if( ( letter >= 'a' ) && ( letter <= 'z' ) )
+        letter = char( letter - 'a' + 'A' );
+    if( ( letter < 'A' ) || ( letter > 'Z' ) )
+        return 0;
+    uint32_t number = 0;
+    for( size_t i = 1; i < cmd.size(); ++i ) {
+        if( ( cmd[i] < '0' ) || ( cmd[i] > '9' ) )
+            return 0;
+        number = ( number * 10 + uint32_t( cmd[i] - '0' ) );
+    }
+    return ( ( number <= 0xFFFF ) ? makeOpcode( letter, number ) : 0 );
+}
+
+inline std::string opcodeName( const Opcode& op ) {
+    return ( std::string( 1, char( op >> 16 ) ) + std::to_string( op & 0xFFFF ) );
+}
 
 struct Axes {
     float _x;
@@ -336,313 +1860,4540 @@ struct Axes {
         _z(z), _e(e), _f(f) {}
 };
 
-class StepperMotor {
-public:
-    virtual ~StepperMotor() {}
+/** @brief Подсказки из заголовка слайсера (Cura): ";MINX:96.5", ";MAXY:138.5", ";MAXZ:20" и т. д.
+ *         Хранится в заголовке .gtp, поэтому должна оставаться тривиально копируемой
+ * */
+struct SlicerHeader {
+    enum Field : uint32_t {
+        MIN_X = 1,
+        MAX_X = 2,
+        MIN_Y = 4,
+        MAX_Y = 8,
+        MAX_Z = 16,
+        TIME = 32,
+        LAYER_HEIGHT = 64
+    };
+
+    float minX = 0;
+    float maxX = 0;
+    float minY = 0;
+    float maxY = 0;
+    float maxZ = 0;
+    float time = 0;         // оценка времени печати слайсером, с
+    float layerHeight = 0;  // мм
+    uint32_t fields = 0;  // Какие поля были в заголовке, битовая маска Field
+
+    bool hasBounds() const noexcept {
+        const uint32_t xy = ( MIN_X | MAX_X | MIN_Y | MAX_Y );
+        return ( ( ( fields & xy ) == xy ) && ( minX <= maxX ) && ( minY <= maxY ) );
+    }
+
+    /** @brief Разобрать строку комментария заголовка
+     *  @return true, если строка содержала известное поле
+     * */
+    bool parse( const std::string_view& line ) {
+        static constexpr std::pair<std::string_view, Field> keys[] = {
+            { ";MINX:", MIN_X }, { ";MAXX:", MAX_X }, { ";MINY:", MIN_Y }, { ";MAXY:", MAX_Y }, { ";MAXZ:", MAX_Z },
+            { ";TIME:", TIME }, { ";Layer height:", LAYER_HEIGHT }
+        };
+        for( const auto& [key, field] : keys ) {
+            if( line.substr( 0, key.size() ) != key )
+                continue;
+            std::string_view text = line.substr( key.size() );
+            text.remove_prefix( std::min( text.find_first_not_of( ' ' ), text.size() ) );
+            float value = 0;
+            if( std::from_chars( text.data(), ( text.data() + text.size() ), value ).ec != std::errc() )
+                return false;
+            switch( field ) {
+                case MIN_X: minX = value; break;
+                case MAX_X: maxX = value; break;
+                case MIN_Y: minY = value; break;
+                case MAX_Y: maxY = value; break;
+                case MAX_Z: maxZ = value; break;
+                case TIME: time = value; break;
+                case LAYER_HEIGHT: layerHeight = value; break;
+            }
+            fields |= field;
+            return true;
+        }
+        return false;
+    }
+};
+
+/** @brief 64-битный хеш FNV-1a, которым помечаются исходный файл скомпилированной траектории
+ *         и текст слоев при повторном разборе
+ *  @param seed Хеш предыдущей части, чтобы продолжить его следующими данными
+ * */
+inline uint64_t fnv1a64( const std::string_view& data, const uint64_t& seed = 0xcbf29ce484222325ULL ) noexcept {
+    uint64_t hash = seed;
+    for( const char& c : data ) {
+        hash ^= uint8_t( c );
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/** @brief Модальное состояние исполнителя между командами: предыдущая точка в 0.1 мм, позиция
+ *         экструдера, текущий слой. Достаточно для продолжения разбора с любой строки смены слоя
+ * */
+struct MotionState {
+    int _prevX = 0, _prevY = 0, _prevZ = 0, _prevE = 0;
+    float extruder = 0;       // последняя абсолютная позиция E
+    float layerZ = 0;
+    float layerHeight = 0.2f;
+    size_t layers = 0;        // сохранено слоев
+    bool isWork = true;
+};
+
+/** @brief Перемещение G0/G1 для пакетной передачи исполнителю. Слова строки отмечены в present,
+ *         поэтому нулевая координата отличается от отсутствующей
+ * */
+struct MoveRecord {
+    enum Axis : uint8_t { X = 1, Y = 2, Z = 4, E = 8, F = 16 };
+
+    Fixed x = 0, y = 0, z = 0, e = 0;
+    uint16_t f = 0;
+    uint8_t present = 0;
+    bool work = false;  // G1, иначе G0
+
+    bool has( const Axis& axis ) const noexcept { return ( present & axis ); }
+
+    /** @brief Axes, в которых отсутствующее слово - это 0
+     * */
+    Axes axes() const noexcept {
+        return Axes( fixedToFloat( x ), fixedToFloat( y ), fixedToFloat( z ), fixedToFloat( e ), f );
+    }
+
+    /** @brief G28: холостой ход в 0, слова X, Y и Z заданы явно
+     * */
+    static MoveRecord home() {
+        MoveRecord r;
+        r.present = ( X | Y | Z );
+        return r;
+    }
+
+    /** @brief Перемещение из Axes старых входов move() и moveE(). Преобразование с потерями: Axes не отличает
+     *         явный 0 от отсутствующего слова, поэтому 0 считается отсутствующим. Разбор передает записи
+     *         с настоящей маской через applyMoves(), где ее знают, fromAxes не вызывается
+     * */
+    static MoveRecord fromAxes( const Axes& ax, const bool& work ) {
+        MoveRecord r;
+        r.x = toFixed( ax._x );
+        r.y = toFixed( ax._y );
+        r.z = toFixed( ax._z );
+        r.e = toFixed( ax._e );
+        r.f = ax._f;
+        r.present = uint8_t( ( ( ax._x != 0 ) ? X : 0 ) | ( ( ax._y != 0 ) ? Y : 0 ) | ( ( ax._z != 0 ) ? Z : 0 ) |
+            ( ( ax._e != 0 ) ? E : 0 ) | ( ( ax._f != 0 ) ? F : 0 ) );
+        r.work = work;
+        return r;
+    }
+};
+
+class StepperMotor {
+public:
+    virtual ~StepperMotor() {}
+
+    /** @brief Выполнить подряд идущие перемещения одним вызовом. По умолчанию каждое передается в move()
+     *         или moveE(), в Axes явный 0 теряется, поэтому исполнители, которым важна маска present,
+     *         переопределяют этот метод
+     * */
+    virtual void applyMoves( std::span<const MoveRecord> moves ) {
+        for( const MoveRecord& r : moves ) {
+            if( r.work )
+                moveE( r.axes() );
+            else
+                move( r.axes() );
+        }
+    }
+
+    virtual void moveE( const Axes& ax ) = 0;
+    virtual void move( const Axes& ax ) = 0;
+    virtual void setting( const Axes& ax ) = 0;
+
+    virtual void on() = 0;
+    virtual void off() = 0;
+
+    virtual void relativeAxes() = 0;
+    virtual void absoluteAxes() = 0;
+
+    /** @brief Подсказки заголовка слайсера. Вызывается один раз перед первой командой, если заголовок был
+     * */
+    virtual void header( const SlicerHeader& hdr ) {}
+
+    /** @brief G92 E: новая позиция экструдера без движения
+     * */
+    virtual void resetExtruder( const float& e ) {}
+
+    /** @brief Дождаться завершения отложенной работы (например, записи слоев)
+     *  @exception MatrixException() Ошибка, случившаяся в фоне
+     * */
+    virtual void flush() {}
+
+    /** @brief Исполнитель для параллельного разбора по слоям: то же состояние и общий вывод
+     *  @param dry Только следить за состоянием, ничего не рисовать и не сохранять
+     *  @return nullptr, если исполнитель не умеет работать участками
+     * */
+    virtual std::unique_ptr<StepperMotor> fork( const bool& dry ) { return nullptr; }
+
+    virtual MotionState state() const { return MotionState(); }
+
+    /** @brief Продолжить с состояния st, снятого перед строкой смены слоя. Слой, который эта строка
+     *         завершает, сохраняет предыдущий участок через endShard()
+     * */
+    virtual void resume( const MotionState& st ) {}
+
+    /** @brief Конец участка: сохранить незавершенный слой так, как его сохранила бы строка смены слоя с высотой z
+     * */
+    virtual void endShard( const float& z ) {}
+
+    /** @brief Файл хешей слоев для повторного разбора, в котором пересчитываются только изменившиеся слои
+     *  @return Пустая строка, если слои нельзя сохранять выборочно
+     * */
+    virtual std::string layerHashPath() const { return ""; }
+
+    /** @brief Хеш настроек, от которых зависит содержимое слоев: при другом ключе старые слои не годятся
+     * */
+    virtual uint64_t outputKey() const { return 0; }
+
+    /** @brief Есть ли на диске слой i, который завершила строка смены слоя с высотой z
+     * */
+    virtual bool hasLayer( const size_t& i, const float& z ) const { return false; }
+
+    /** @brief Удалить файлы слоя i с высотой z прошлого разбора, которого нет в новом файле
+     * */
+    virtual void removeLayer( const size_t& i, const float& z ) {}
+};
+
+/** @brief Запись индекса слоев: где в полной матрице стола лежит сохраненная область слоя
+ * */
+struct LayerIndexEntry {
+    size_t layer = 0;
+    float z = 0;
+    std::string fileName;
+    Region region;
+    size_t scale = 1;  // уменьшение: 1 - сам слой, 4 - миниатюра в 1/4 стороны
+};
+
+/** @brief Место, куда попадают закодированные слои. write() вызывается из потоков записи одновременно
+ * */
+class LayerSink {
+public:
+    virtual ~LayerSink() {}
+
+    virtual void write( const LayerIndexEntry& entry, const std::vector<uint8_t>& bytes ) = 0;
+
+    /** @brief Все слои записаны
+     * */
+    virtual void finish() {}
+};
+
+/** @brief Каждый слой в отдельный файл entry.fileName
+ * */
+class DirectorySink : public LayerSink {
+public:
+    void write( const LayerIndexEntry& entry, const std::vector<uint8_t>& bytes ) override {
+        writeFile( entry.fileName, bytes );
+    }
+};
+
+/** @brief Формат архива слоев (.gla): заголовок, затем закодированные слои подряд, затем индекс
+ *         из LayerArchiveEntry и концевик. Все числа в порядке байт машины
+ * */
+struct LayerArchiveHeader {
+    static constexpr uint32_t MAGIC = 0x31414c47;  // "GLA1"
+    static constexpr uint32_t VERSION = 2;          // 2: миниатюры слоев в индексе
+
+    uint32_t magic;
+    uint32_t version;
+    char extension[8];  // формат слоев: jpg, qoi, pbm, pgm
+    uint32_t rows;      // размер полной матрицы стола
+    uint32_t cols;
+    uint64_t reserved;
+};
+static_assert( sizeof(LayerArchiveHeader) == 32, "LayerArchiveHeader должен иметь фиксированный размер" );
+
+struct LayerArchiveEntry {
+    uint64_t layer;
+    uint64_t offset;
+    uint64_t size;
+    float z;
+    uint32_t col;  // область слоя в матрице стола
+    uint32_t row;
+    uint32_t cols;
+    uint32_t rows;
+    uint32_t scale;  // 1 - слой, иначе миниатюра с уменьшением scale; в версии 1 всегда 0
+};
+static_assert( sizeof(LayerArchiveEntry) == 48, "LayerArchiveEntry должен иметь фиксированный размер" );
+
+struct LayerArchiveFooter {
+    static constexpr uint32_t MAGIC = 0x49414c47;  // "GLAI"
+
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t indexOffset;
+    uint64_t count;
+};
+static_assert( sizeof(LayerArchiveFooter) == 24, "LayerArchiveFooter должен иметь фиксированный размер" );
+
+/** @brief Все слои в одном файле, который только дописывается. Каждый поток записи резервирует себе
+ *         место атомарным сдвигом конца файла и пишет pwrite без блокировки, индекс пишется в finish()
+ * */
+class LayerArchive : public LayerSink {
+    std::string path;
+    int fd;
+    std::atomic<uint64_t> end;
+    std::mutex mutex;
+    std::vector<LayerArchiveEntry> index;
+
+    void writeAt( const void* data, const size_t& size, uint64_t offset ) {
+        const char* bytes = static_cast<const char*>( data );
+        for( size_t done = 0; done < size; ) {
+            const ssize_t n = pwrite( fd, ( bytes + done ), ( size - done ), off_t( offset + done ) );
+            if( n <= 0 )
+                throw MatrixException( "Ошибка записи файла: " + path );
+            done += size_t( n );
+        }
+    }
+
+public:
+    /** @param fileName Файл архива, перезаписывается
+     *  @param extension Формат слоев
+     *  @param rows Строки матрицы стола
+     *  @param cols Колонки матрицы стола
+     * */
+    LayerArchive( const std::string& fileName, const std::string& extension, const size_t& rows,
+            const size_t& cols ) : path(fileName), end( sizeof(LayerArchiveHeader) ) {
+        fd = open( path.c_str(), ( O_WRONLY | O_CREAT | O_TRUNC ), 0644 );
+        if( fd < 0 )
+            throw MatrixException( "Не удалось открыть файл: " + path );
+        LayerArchiveHeader header{};
+        header.magic = LayerArchiveHeader::MAGIC;
+        header.version = LayerArchiveHeader::VERSION;
+        extension.copy( header.extension, ( sizeof(header.extension) - 1 ) );
+        header.rows = rows;
+        header.cols = cols;
+        writeAt( &header, sizeof(header), 0 );
+    }
+
+    LayerArchive( const LayerArchive& ) = delete;
+    LayerArchive& operator=( const LayerArchive& ) = delete;
+
+    ~LayerArchive() {
+        close( fd );
+    }
+
+    void write( const LayerIndexEntry& entry, const std::vector<uint8_t>& bytes ) override {
+        const uint64_t offset = end.fetch_add( bytes.size() );
+        writeAt( bytes.data(), bytes.size(), offset );
+        LayerArchiveEntry e{};
+        e.layer = entry.layer;
+        e.offset = offset;
+        e.size = bytes.size();
+        e.z = entry.z;
+        e.col = entry.region.col;
+        e.row = entry.region.row;
+        e.cols = entry.region.cols;
+        e.rows = entry.region.rows;
+        e.scale = uint32_t( entry.scale );
+        std::lock_guard<std::mutex> lock( mutex );
+        index.push_back( e );
+    }
+
+    void finish() override {
+        std::lock_guard<std::mutex> lock( mutex );
+        std::sort( index.begin(), index.end(), []( const LayerArchiveEntry& a, const LayerArchiveEntry& b ) {
+            return ( ( a.layer != b.layer ) ? ( a.layer < b.layer ) : ( a.scale < b.scale ) );
+        } );
+        LayerArchiveFooter footer{};
+        footer.magic = LayerArchiveFooter::MAGIC;
+        footer.indexOffset = end.load();
+        footer.count = index.size();
+        writeAt( index.data(), ( index.size() * sizeof(LayerArchiveEntry) ), footer.indexOffset );
+        writeAt( &footer, sizeof(footer), ( footer.indexOffset + index.size() * sizeof(LayerArchiveEntry) ) );
+        if( ftruncate( fd, off_t( footer.indexOffset + index.size() * sizeof(LayerArchiveEntry) +
+                sizeof(footer) ) ) != 0 )
+            throw MatrixException( "Ошибка записи файла: " + path );
+    }
+};
+
+/** @brief Чтение архива слоев: индекс читается при открытии, слой извлекается по номеру без чтения остальных
+ * */
+class LayerArchiveReader {
+    std::string path;
+    int fd;
+    LayerArchiveHeader header;
+    std::vector<LayerArchiveEntry> index;
+
+    void readAt( void* data, const size_t& size, const uint64_t& offset ) const {
+        char* bytes = static_cast<char*>( data );
+        for( size_t done = 0; done < size; ) {
+            const ssize_t n = pread( fd, ( bytes + done ), ( size - done ), off_t( offset + done ) );
+            if( n <= 0 )
+                throw MatrixException( "Испорченный архив слоев: " + path );
+            done += size_t( n );
+        }
+    }
+
+public:
+    /** @exception MatrixException() Файл не открылся или это не завершенный архив слоев
+     * */
+    explicit LayerArchiveReader( const std::string& fileName ) : path(fileName) {
+        fd = open( path.c_str(), O_RDONLY );
+        struct stat st;
+        if( ( fd < 0 ) || ( fstat( fd, &st ) != 0 ) ) {
+            if( fd >= 0 )
+                close( fd );
+            throw MatrixException( "Не удалось открыть файл: " + path );
+        }
+        try {
+            LayerArchiveFooter footer;
+            if( size_t( st.st_size ) < ( sizeof(header) + sizeof(footer) ) )
+                throw MatrixException( "Испорченный архив слоев: " + path );
+            readAt( &header, sizeof(header), 0 );
+            readAt( &footer, sizeof(footer), ( st.st_size - sizeof(footer) ) );
+            if( ( header.magic != LayerArchiveHeader::MAGIC ) || ( header.version == 0 ) ||
+                    ( header.version > LayerArchiveHeader::VERSION ) ||
+                    ( footer.magic != LayerArchiveFooter::MAGIC ) || ( ( footer.indexOffset +
+                    footer.count * sizeof(LayerArchiveEntry) + sizeof(footer) ) != uint64_t( st.st_size ) ) )
+                throw MatrixException( "Испорченный архив слоев: " + path );
+            index.resize( footer.count );
+            readAt( index.data(), ( index.size() * sizeof(LayerArchiveEntry) ), footer.indexOffset );
+        } catch ( ... ) {
+            close( fd );
+            throw;
+        }
+    }
+
+    LayerArchiveReader( const LayerArchiveReader& ) = delete;
+    LayerArchiveReader& operator=( const LayerArchiveReader& ) = delete;
+
+    ~LayerArchiveReader() {
+        close( fd );
+    }
+
+    size_t size() const noexcept { return index.size(); }
+    std::string extension() const { return std::string( header.extension ); }
+    const LayerArchiveEntry& entry( const size_t& i ) const { return index.at( i ); }
+    uint32_t scale( const size_t& i ) const { return std::max<uint32_t>( entry( i ).scale, 1 ); }
+
+    /** @brief Прочитать закодированный слой с порядковым номером i в индексе
+     * */
+    void read( const size_t& i, std::vector<uint8_t>& bytes ) const {
+        const LayerArchiveEntry& e = entry( i );
+        bytes.resize( e.size );
+        readAt( bytes.data(), bytes.size(), e.offset );
+    }
+};
+
+/** @brief Пул потоков, кодирующих слои в фоне, пока растеризуется следующий слой.
+ *         Матрицы слоев переиспользуются: после записи матрица очищается и возвращается в пул.
+ *         Каждый поток собирает слой в собственную плотную матрицу и кодирует уже ее.
+ *         Одновременно в очереди и в работе не больше inFlight слоев, поэтому тайловых матриц слоя не больше
+ *         ( inFlight + 1 ). Сверх них каждый поток держит, пока жив, свою плотную матрицу размером до слоя,
+ *         а с миниатюрами - еще и их уменьшенные уровни. Ошибка записи сохраняется и выбрасывается из submit()
+ *         или wait()
+ * */
+class LayerWriter {
+    struct Job {
+        std::unique_ptr<TiledMatrix> layer;
+        LayerIndexEntry entry;
+        bool fit;
+        int64_t submitted;  // PROFILE_NOW() при постановке в очередь
+    };
+
+    size_t rows;
+    size_t cols;
+    EncoderOptions encoding;
+    LayerSink& sink;
+    size_t limit;
+    size_t allocated;
+    size_t busy;
+    bool stopping;
+    std::vector<size_t> mips;
+    std::deque<Job> jobs;
+    std::vector<std::unique_ptr<TiledMatrix>> pool;
+    std::vector<LayerIndexEntry> written;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable jobReady;
+    std::condition_variable layerFree;
+    std::vector<std::thread> workers;
+
+    /** @brief Уменьшения миниатюр по возрастанию, без повторов; 0 и 1 пропускаются
+     * */
+    static std::vector<size_t> mipLevels( const std::vector<size_t>& scales ) {
+        std::vector<size_t> levels;
+        for( const size_t& scale : scales )
+            if( scale > 1 )
+                levels.push_back( scale );
+        std::sort( levels.begin(), levels.end() );
+        levels.erase( std::unique( levels.begin(), levels.end() ), levels.end() );
+        return levels;
+    }
+
+    /** @brief "img/layer_3_0.6.jpg" -> "img/layer_3_0.6.mip4.jpg"
+     * */
+    static std::string mipPath( const std::string& fileName, const size_t& scale ) {
+        const size_t dot = fileName.rfind( '.' );
+        const size_t slash = fileName.rfind( '/' );
+        const size_t at = ( ( ( dot == std::string::npos ) || ( ( slash != std::string::npos ) && ( dot < slash ) ) ) ?
+            fileName.size() : dot );
+        return ( fileName.substr( 0, at ) + ".mip" + std::to_string( scale ) + fileName.substr( at ) );
+    }
+
+    /** @brief Миниатюры слоя из frame. Уровень строится из предыдущего, если его уменьшение делится
+     *         на уменьшение предыдущего, иначе из самого слоя
+     * */
+    void writeMips( const Matrix& frame, const LayerIndexEntry& entry, std::vector<Matrix>& levels,
+            std::vector<uint8_t>& row, LayerEncoder& encoder, std::vector<uint8_t>& bytes ) {
+        levels.resize( mips.size() );
+        const Matrix* source = &frame;
+        size_t done = 1;
+        for( size_t k = 0; k < mips.size(); ++k ) {
+            const bool chained = ( ( mips[k] % done ) == 0 );
+            {
+                PROFILE_SCOPE( MIPS );
+                downsampleMax( ( chained ? *source : frame ), ( chained ? ( mips[k] / done ) : mips[k] ), levels[k], row );
+            }
+            source = &levels[k];
+            done = mips[k];
+            LayerIndexEntry mip = entry;
+            mip.scale = mips[k];
+            mip.fileName = mipPath( entry.fileName, mips[k] );
+            mip.region.col /= mips[k];
+            mip.region.row /= mips[k];
+            mip.region.cols = levels[k].getCols();
+            mip.region.rows = levels[k].getRows();
+            {
+                PROFILE_SCOPE( ENCODE );
+                encoder.encode( levels[k], bytes );
+            }
+            PROFILE_COUNT( BYTES, bytes.size() );
+            {
+                PROFILE_SCOPE( WRITE );
+                sink.write( mip, bytes );
+            }
+        }
+    }
+
+    void work() {
+        Matrix frame;
+        std::vector<Matrix> levels;
+        std::vector<uint8_t> row;
+        std::vector<uint8_t> bytes;
+        const std::unique_ptr<LayerEncoder> encoder = makeEncoder( encoding );
+        std::unique_lock<std::mutex> lock( mutex );
+        while( true ) {
+            jobReady.wait( lock, [this]() { return ( stopping || !jobs.empty() ); } );
+            if( jobs.empty() )
+                return;
+            Job job = std::move( jobs.front() );
+            jobs.pop_front();
+            ++busy;
+            lock.unlock();
+            std::exception_ptr failure;
+            try {
+                if( job.fit ) {
+                    job.entry.region = job.layer->extents();
+                    if( job.entry.region.empty() )
+                        job.entry.region.rows = job.entry.region.cols = 1;
+                }
+                {
+                    PROFILE_SCOPE( EXPORT );
+                    job.layer->exportTo( frame, job.entry.region );
+                }
+                {
+                    PROFILE_SCOPE( ENCODE );
+                    encoder->encode( frame, bytes );
+                }
+                PROFILE_COUNT( BYTES, bytes.size() );
+                {
+                    PROFILE_SCOPE( WRITE );
+                    sink.write( job.entry, bytes );
+                }
+                if( !mips.empty() )
+                    writeMips( frame, job.entry, levels, row, *encoder, bytes );
+                PROFILE_COUNT( LAYERS, 1 );
+                PROFILE_LATENCY( job.submitted );
+            } catch ( ... ) {
+                failure = std::current_exception();
+            }
+            job.layer->clear();
+            lock.lock();
+            --busy;
+            if( failure && !error )
+                error = failure;
+            if( !failure )
+                written.push_back( std::move( job.entry ) );
+            pool.push_back( std::move( job.layer ) );
+            layerFree.notify_all();
+        }
+    }
+
+    void rethrow() {
+        if( error ) {
+            std::exception_ptr e = error;
+            error = nullptr;
+            std::rethrow_exception( e );
+        }
+    }
+
+public:
+    /** @param rows Строки матрицы слоя
+     *  @param cols Колонки матрицы слоя
+     *  @param encoding Формат слоев, у каждого потока свой кодировщик
+     *  @param sink Куда писать закодированные слои, должен пережить LayerWriter
+     *  @param threads Потоков записи
+     *  @param inFlight Сколько слоев может ожидать записи одновременно
+     *  @param mipScales Уменьшения миниатюр каждого слоя, например { 4, 16 }; 0 и 1 пропускаются
+     * */
+    LayerWriter( const size_t& rows, const size_t& cols, const EncoderOptions& encoding, LayerSink& sink,
+            const size_t& threads, const size_t& inFlight, const std::vector<size_t>& mipScales = {} ) : rows(rows),
+            cols(cols), encoding(encoding), sink(sink), limit( ( std::max<size_t>( inFlight, 1 ) + 1 ) ), allocated(0),
+            busy(0), stopping(false), mips( mipLevels( mipScales ) ) {
+        for( size_t i = 0; i < std::max<size_t>( threads, 1 ); ++i )
+            workers.emplace_back( &LayerWriter::work, this );
+    }
+
+    LayerWriter( const LayerWriter& ) = delete;
+    LayerWriter& operator=( const LayerWriter& ) = delete;
+
+    /** @brief Наибольший объем матриц писателя с такими параметрами в байтах: ( inFlight + 1 ) тайловых
+     *         матриц слоя со всеми плитками и у каждого потока плотный кадр слоя со всеми уровнями миниатюр
+     * */
+    static size_t peakBytes( const size_t& rows, const size_t& cols, const size_t& threads, const size_t& inFlight,
+            const std::vector<size_t>& mipScales = {} ) {
+        const size_t tile = TiledMatrix::TILE;
+        const size_t tiled = ( ( ( rows + tile - 1 ) / tile ) * ( ( cols + tile - 1 ) / tile ) * tile * tile );
+        size_t frame = ( rows * cols );
+        // уровень k строится из уровня k - 1 или из слоя, но его размер зависит только от уменьшения
+        for( const size_t& scale : mipLevels( mipScales ) )
+            frame += ( ( ( rows + scale - 1 ) / scale ) * ( ( cols + scale - 1 ) / scale ) );
+        return ( ( ( std::max<size_t>( inFlight, 1 ) + 1 ) * tiled ) + ( std::max<size_t>( threads, 1 ) * frame ) );
+    }
+
+    ~LayerWriter() {
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            stopping = true;
+        }
+        jobReady.notify_all();
+        for( auto& worker : workers )
+            worker.join();
+    }
+
+    /** @brief Получить чистую матрицу слоя. Ждет, если все inFlight слоев еще пишутся
+     * */
+    std::unique_ptr<TiledMatrix> acquire() {
+        std::unique_lock<std::mutex> lock( mutex );
+        layerFree.wait( lock, [this]() { return ( !pool.empty() || ( allocated < limit ) ); } );
+        if( pool.empty() ) {
+            ++allocated;
+            lock.unlock();
+            return std::make_unique<TiledMatrix>( rows, cols );
+        }
+        std::unique_ptr<TiledMatrix> layer = std::move( pool.back() );
+        pool.pop_back();
+        return layer;
+    }
+
+    /** @brief Вернуть неиспользованную матрицу слоя
+     * */
+    void release( std::unique_ptr<TiledMatrix> layer ) {
+        if( !layer )
+            return;
+        layer->clear();
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            pool.push_back( std::move( layer ) );
+        }
+        layerFree.notify_all();
+    }
+
+    /** @brief Поставить слой в очередь на запись
+     *  @param entry Номер слоя, высота, файл и сохраняемая область
+     *  @param fit Вместо entry.region сохранить точные границы ненулевых точек слоя
+     *  @exception MatrixException() Ошибка записи одного из предыдущих слоев
+     * */
+    void submit( std::unique_ptr<TiledMatrix> layer, LayerIndexEntry entry, const bool& fit = false ) {
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            jobs.push_back( Job{ std::move( layer ), std::move( entry ), fit, PROFILE_NOW() } );
+            rethrow();
+        }
+        jobReady.notify_one();
+    }
+
+    /** @brief Изъять записи индекса уже сохраненных слоев, упорядоченные по номеру слоя
+     * */
+    std::vector<LayerIndexEntry> takeIndex() {
+        std::vector<LayerIndexEntry> index;
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            index.swap( written );
+        }
+        std::sort( index.begin(), index.end(), []( const LayerIndexEntry& a, const LayerIndexEntry& b ) {
+            return ( a.layer < b.layer );
+        } );
+        return index;
+    }
+
+    /** @brief Дождаться записи всех слоев
+     *  @exception MatrixException() Ошибка записи
+     * */
+    void wait() {
+        std::unique_lock<std::mutex> lock( mutex );
+        layerFree.wait( lock, [this]() { return ( jobs.empty() && ( busy == 0 ) ); } );
+        rethrow();
+    }
+};
+
+/** @brief Профиль станка: механика осей, сторона стола и размер точки растра. Макросы выше - значения
+ *         по умолчанию, при запуске профиль уточняется файлом и ключами командной строки
+ * */
+struct MachineProfile {
+    int64_t stepsPerRev = SIZE_STEPS;
+    int64_t microstep = MICROSTEP;
+    int64_t beltPitch = BELT_PITCH;       // мм
+    int64_t pulleyTeeth = NUMBER_TEETH_PULLEY;
+    int64_t zStepsPerMm = Z_STEPS_PER_MM;
+    int64_t eStepsPerMm = E_STEPS_PER_MM;
+    float tableSize = TABLE_SIZE_MM;      // мм
+    Fixed pixelsPerMm = PIXELS_PER_MM;    // делитель FIXED_SCALE: 2 - точка 0.5 мм, 20 - точка 0.05 мм
+
+    /** @brief Сторона матрицы слоя в точках
+     * */
+    size_t side() const { return size_t( std::lround( tableSize * float( pixelsPerMm ) ) ); }
+
+    /** @brief Шагов на мм по X, Y, Z, E: X и Y через ремень stepsPerRev * microstep / ( beltPitch * pulleyTeeth )
+     * */
+    std::array<int64_t, 4> stepsPerMm() const {
+        const int64_t belt = ( stepsPerRev * microstep / ( beltPitch * pulleyTeeth ) );
+        return { belt, belt, zStepsPerMm, eStepsPerMm };
+    }
+
+    /** @brief Задать параметр по ключу профиля: steps_per_rev, microstep, belt_pitch, pulley_teeth,
+     *         z_steps_per_mm, e_steps_per_mm, table_size (мм), pixel (мм) или pixels_per_mm
+     *  @return false, если ключ не относится к станку
+     *  @exception CNCException() Недопустимое значение
+     * */
+    bool set( const std::string& key, const std::string& value ) {
+        const auto positive = [&]() {
+            int64_t v = 0;
+            const auto [end, ec] = std::from_chars( value.data(), ( value.data() + value.size() ), v );
+            if( ( ec != std::errc() ) || ( end != ( value.data() + value.size() ) ) || ( v <= 0 ) )
+                throw CNCException( "Профиль станка: " + key + " должен быть целым больше 0: " + value );
+            return v;
+        };
+        const auto length = [&]() {
+            char* end = nullptr;
+            const float v = std::strtof( value.c_str(), &end );
+            if( value.empty() || ( *end != '\0' ) || !( v > 0 ) )
+                throw CNCException( "Профиль станка: " + key + " должен быть числом больше 0: " + value );
+            return v;
+        };
+        // точка в целое число раз меньше мм и кратна единице Fixed, иначе fixedTo округлял бы неточно
+        const auto resolution = [&]( const Fixed& ppm ) {
+            if( ( ppm <= 0 ) || ( ( FIXED_SCALE % ppm ) != 0 ) )
+                throw CNCException( "Профиль станка: точка должна быть 1/N мм, N - делитель " +
+                    std::to_string( FIXED_SCALE ) + ": " + value );
+            return ppm;
+        };
+        if( key == "steps_per_rev" )
+            stepsPerRev = positive();
+        else if( key == "microstep" )
+            microstep = positive();
+        else if( key == "belt_pitch" )
+            beltPitch = positive();
+        else if( key == "pulley_teeth" )
+            pulleyTeeth = positive();
+        else if( key == "z_steps_per_mm" )
+            zStepsPerMm = positive();
+        else if( key == "e_steps_per_mm" )
+            eStepsPerMm = positive();
+        else if( key == "table_size" )
+            tableSize = length();
+        else if( key == "pixels_per_mm" )
+            pixelsPerMm = resolution( positive() );
+        else if( key == "pixel" ) {
+            const float mm = length();
+            const Fixed ppm = Fixed( std::llround( 1.0f / mm ) );
+            pixelsPerMm = resolution( ( std::fabs( float( ppm ) * mm - 1.0f ) < 1e-4f ) ? ppm : 0 );
+        } else
+            return false;
+        return true;
+    }
+};
+
+/** @brief Настройки запуска: профиль станка, входной файл и каталог результатов. Загружаются из файла
+ *         строк key = value (--machine), ключи командной строки после него уточняют файл
+ * */
+struct RuntimeConfig {
+    MachineProfile machine;
+    std::string input = FILE_NAME;
+    std::string outputDir = "img";
+
+    /** @brief Параметр станка или input, output
+     *  @exception CNCException() Неизвестный ключ или недопустимое значение
+     * */
+    void set( const std::string& key, const std::string& value ) {
+        if( key == "input" )
+            input = value;
+        else if( key == "output" )
+            outputDir = value;
+        else if( !machine.set( key, value ) )
+            throw CNCException( "Неизвестный параметр профиля: " + key );
+    }
+
+    /** @brief Прочитать профиль: строка key = value, после # или ; - комментарий, пустые строки пропускаются
+     *  @exception FileNotOpen() Не удалось открыть файл
+     *  @exception CNCException() Ошибка в строке, с ее номером
+     * */
+    void load( const std::string& path ) {
+        std::ifstream file( path );
+        if( !file )
+            throw FileNotOpen( "Не удалось открыть профиль: " + path );
+        const auto trim = []( std::string_view v ) {
+            while( !v.empty() && std::isspace( static_cast<unsigned char>( v.front() ) ) )
+                v.remove_prefix( 1 );
+            while( !v.empty() && std::isspace( static_cast<unsigned char>( v.back() ) ) )
+                v.remove_suffix( 1 );
+            return std::string( v );
+        };
+        size_t number = 0;
+        for( std::string line; std::getline( file, line ); ) {
+            ++number;
+            const std::string text = trim( std::string_view( line ).substr( 0, line.find_first_of( "#;" ) ) );
+            if( text.empty() )
+                continue;
+            const size_t eq = text.find( '=' );
+            try {
+                if( eq == std::string::npos )
+                    throw CNCException( "нет '=': " + text );
+                set( trim( std::string_view( text ).substr( 0, eq ) ), trim( std::string_view( text ).substr( eq + 1 ) ) );
+            } catch ( const CNCException& ce ) {
+                throw CNCException( path + ":" + std::to_string( number ) + ": " + ce.what() );
+            }
+        }
+    }
+};
+
+struct MatrixMotorOptions {
+    size_t writers = 1;   // потоков записи слоев
+    size_t inFlight = 2;  // слоев, ожидающих записи одновременно
+    bool crop = false;    // сохранять только занятую область: по ;MINX/;MAXX/;MINY/;MAXY или по границам слоя
+    EncoderOptions encoder;
+    bool archive = false; // все слои в один файл layers.gla вместо файла на слой
+    std::string outputDir = "img";  // каталог слоев, layers.csv и layers.gla
+    bool capsule = false;    // рисовать экструзию капсулами реальной ширины вместо линий Брезенхэма
+    bool antialias = false;  // сглаживание краев капсул
+    size_t rasterThreads = 1; // потоков растеризации слоя полосами
+    float filament = 1.75f;   // диаметр прутка, мм
+    float layerHeight = 0.2f; // высота первого слоя, далее берется из разницы Z слоев
+    std::vector<size_t> mips; // уменьшения миниатюр рядом с каждым слоем, например { 4, 16 }
+    MachineProfile machine;   // сторона стола и размер точки
+};
+
+class MatrixMotor final : public StepperMotor, private MotionState {
+    static constexpr int CROP_MARGIN = 2;  // запас в точках вокруг области из заголовка
+
+    int _x = 0, _y = 0, _z = 0, _e = 0;
+    MatrixMotorOptions options;
+    Fixed ppm;                            // точек на мм из профиля
+    std::string extension;
+    std::shared_ptr<LayerSink> sink;      // общие для всех участков fork()
+    std::shared_ptr<LayerWriter> writer;
+    std::shared_ptr<std::atomic<uint64_t>> drawn = std::make_shared<std::atomic<uint64_t>>( 0 );  // отрезков
+    std::unique_ptr<TiledMatrix> m;
+    SegmentBuffer segments;
+    Region crop;
+    bool fitLayers;
+    bool dry = false;
+    bool resumed = false;  // первую смену слоя после resume() сохраняет предыдущий участок
+
+    void saveLayer( const float& layer ) {
+        const size_t i = layers++;
+        if( layer > layerZ )
+            layerHeight = std::clamp( ( layer - layerZ ), 0.01f, 1.0f );
+        layerZ = layer;
+        if( dry || std::exchange( resumed, false ) ) {
+            segments.clear();
+            return;
+        }
+        LayerIndexEntry entry;
+        entry.layer = i;
+        entry.z = layer;
+        entry.fileName = layerPath( i, layer );
+        entry.region = crop;
+        {
+            PROFILE_SCOPE( RASTER );
+            m->drawSegments( segments, 255, options.antialias, options.rasterThreads );
+        }
+        PROFILE_COUNT( SEGMENTS, segments.size() );
+        drawn->fetch_add( segments.size(), std::memory_order_relaxed );
+        segments.clear();
+        writer->submit( std::move( m ), std::move( entry ), fitLayers );
+        m = writer->acquire();
+    }
+
+    /** @brief Точка растра из Fixed. PPM - заготовка частого разрешения, с ней деления fixedTo
+     *         сворачиваются компилятором в умножения; 0 - разрешение профиля
+     * */
+    template<Fixed PPM>
+    int pixel( const Fixed& v ) const {
+        static_assert( ( PPM == 0 ) || ( ( FIXED_SCALE % PPM ) == 0 ) );
+        return int( fixedTo( v, ( ( PPM != 0 ) ? PPM : ppm ) ) );
+    }
+
+    /** @brief G0/G1: смена слоя по Z, затем отрезок из предыдущей точки. Холостой ход только переносит точку.
+     *         Точки растра получаются из Fixed целочисленным округлением
+     * */
+    template<Fixed PPM = 0>
+    void step( const MoveRecord& r ) {
+        if( !isWork )
+            return;
+
+        _x = ( r.has( MoveRecord::X ) ? pixel<PPM>( r.x ) : _prevX );
+        _y = ( r.has( MoveRecord::Y ) ? pixel<PPM>( r.y ) : _prevY );
+        if( r.has( MoveRecord::Z ) )
+            saveLayer( fixedToFloat( r.z ) );
+
+        if( ( _prevX == _x ) && ( _prevY == _y ) ) {
+            if( r.work && options.capsule && r.has( MoveRecord::E ) )
+                extruder = fixedToFloat( r.e );
+            return;
+        }
+
+        if( r.work ) {
+            if( options.capsule )
+                extrude( r );
+            else
+                segments.push( _prevX, _prevY, _x, _y, 0 );
+        }
+        _prevX = _x;
+        _prevY = _y;
+        if( r.has( MoveRecord::Z ) )
+            _prevZ = pixel<PPM>( r.z );
+        if( r.has( MoveRecord::E ) )
+            _prevE = pixel<PPM>( r.e );
+    }
+
+    template<Fixed PPM>
+    void steps( std::span<const MoveRecord> moves ) {
+        for( const MoveRecord& r : moves )
+            step<PPM>( r );
+    }
+
+    std::string layerPath( const size_t& i, const float& layer ) const {
+        std::string strL = std::to_string( ( std::round( layer * 10 ) / 10 ) );
+        strL = strL.substr( 0, ( strL.length() - 5 ) );
+        return ( options.outputDir + "/layer_" + std::to_string( i ) + "_" + strL + "." + extension );
+    }
+
+    std::shared_ptr<LayerSink> makeSink() const {
+        if( options.archive )
+            return std::make_unique<LayerArchive>( ( options.outputDir + "/layers.gla" ), extension,
+                options.machine.side(), options.machine.side() );
+        return std::make_unique<DirectorySink>();
+    }
+
+    /** @brief Капсула ширины, при которой объем валика сечением width x layerHeight равен объему
+     *         выдавленного прутка: width = pi * d^2 / 4 * dE / ( layerHeight * length ).
+     *         Отрезки без подачи или с откатом не рисуются
+     * */
+    void extrude( const MoveRecord& r ) {
+        if( !r.has( MoveRecord::E ) )
+            return;
+        const float feed = ( fixedToFloat( r.e ) - extruder );
+        extruder = fixedToFloat( r.e );
+        const float length = ( std::hypot( float( _x - _prevX ), float( _y - _prevY ) ) / float( ppm ) );
+        if( ( feed <= 0 ) || ( length <= 0 ) )
+            return;
+        const float area = ( std::numbers::pi_v<float> * options.filament * options.filament / 4 );
+        const float width = std::min( ( area * feed / ( layerHeight * length ) ), 5.0f );
+        segments.push( _prevX, _prevY, _x, _y, ( width * float( ppm ) ) );
+    }
+
+    /** @brief Сохранить индекс слоев layers.csv: смещение и размер области каждого слоя в точках стола
+     * */
+    void saveIndex() {
+        const std::string path = ( options.outputDir + "/layers.csv" );
+        std::ofstream index( path, std::ios::trunc );
+        if( !index )
+            throw MatrixException( "Не удалось открыть файл: " + path );
+        index << "layer,z,file,x,y,width,height\n" << std::fixed << std::setprecision(1);
+        for( const LayerIndexEntry& e : writer->takeIndex() )
+            index << e.layer << ',' << e.z << ',' << e.fileName << ',' << e.region.col << ',' << e.region.row << ','
+                  << e.region.cols << ',' << e.region.rows << '\n';
+        if( !index )
+            throw MatrixException( "Ошибка записи файла: " + path );
+    }
+
+public: 
+    explicit MatrixMotor( const MatrixMotorOptions& opts = MatrixMotorOptions() ) : options(opts),
+            ppm(options.machine.pixelsPerMm), extension( makeEncoder( options.encoder )->extension() ),
+            sink( makeSink() ), writer( std::make_shared<LayerWriter>( options.machine.side(), options.machine.side(),
+                options.encoder, *sink, options.writers, options.inFlight, options.mips ) ) {
+        m = writer->acquire();
+        crop.rows = m->getRows();
+        crop.cols = m->getCols();
+        fitLayers = options.crop;
+        layerHeight = options.layerHeight;
+        isWork = true;
+    }
+
+    /** @brief Участок с тем же состоянием, запись слоев общая с parent
+     * */
+    MatrixMotor( const MatrixMotor& parent, const bool& dry ) : MotionState(parent), options(parent.options),
+            ppm(parent.ppm), extension(parent.extension), sink(parent.sink), writer(parent.writer), drawn(parent.drawn),
+            crop(parent.crop),
+            fitLayers(parent.fitLayers), dry(dry) {
+        if( !dry )
+            m = writer->acquire();
+    }
+
+    ~MatrixMotor() {
+        writer->release( std::move( m ) );
+    }
+
+    /** @brief Отрезков нарисовано в сохраненных слоях этим исполнителем и его участками fork()
+     * */
+    uint64_t segmentsDrawn() const { return drawn->load( std::memory_order_relaxed ); }
+
+    /** @brief Пачка выбирает заготовку под разрешение один раз, остальные разрешения идут общим путем
+     * */
+    void applyMoves( std::span<const MoveRecord> moves ) override {
+        switch( ppm ) {
+            case 1: return steps<1>( moves );
+            case 2: return steps<2>( moves );
+            case 5: return steps<5>( moves );
+            case 10: return steps<10>( moves );
+            case 20: return steps<20>( moves );
+            default: return steps<0>( moves );
+        }
+    }
+
+    void moveE( const Axes& ax ) override {
+        step( MoveRecord::fromAxes( ax, true ) );
+    }
+
+    void move( const Axes& ax ) override {
+        step( MoveRecord::fromAxes( ax, false ) );
+    }
+
+    void setting( const Axes& ax ) override {
+        const float scale = float( ppm );
+        _prevX = ( ( ax._x != 0 ) ? std::round( ax._x * scale ) : _prevX );
+        _prevY = ( ( ax._y != 0 ) ? std::round( ax._y * scale ) : _prevX );
+        _prevZ = ( ( ax._z != 0 ) ? std::round( ax._z * scale ) : _prevX );
+        _prevE = ( ( ax._e != 0 ) ? std::round( ax._e * scale ) : _prevX );
+    }
+
+    void on() override {
+        isWork = true;
+        LOG( INFO, "motors", "---> Моторы включены" );
+    }
+
+    void off() override {
+        isWork = false;
+        if( !dry )
+            LOG( INFO, "motors", "---> Моторы отключены" );
+    }
+
+    void relativeAxes() override {
+        LOG( INFO, "axes", "---> Установлены относительные координаты" );
+    }
+    
+    void absoluteAxes() override {
+        LOG( INFO, "axes", "---> Установлены абсолютные координаты" );
+    }
+
+    void resetExtruder( const float& e ) override {
+        extruder = e;
+    }
+
+    void header( const SlicerHeader& hdr ) override {
+        if( ( hdr.fields & SlicerHeader::LAYER_HEIGHT ) && ( hdr.layerHeight > 0 ) && ( layers == 0 ) )
+            layerHeight = hdr.layerHeight;
+        if( !options.crop || !hdr.hasBounds() )
+            return;
+        const float scale = float( ppm );
+        const int c0 = std::max( 0, int( std::floor( hdr.minX * scale ) ) - CROP_MARGIN );
+        const int r0 = std::max( 0, int( std::floor( hdr.minY * scale ) ) - CROP_MARGIN );
+        const int c1 = std::min( int( m->getCols() ), int( std::ceil( hdr.maxX * scale ) ) + CROP_MARGIN + 1 );
+        const int r1 = std::min( int( m->getRows() ), int( std::ceil( hdr.maxY * scale ) ) + CROP_MARGIN + 1 );
+        if( ( c0 >= c1 ) || ( r0 >= r1 ) )
+            return;
+        crop.col = c0;
+        crop.row = r0;
+        crop.cols = ( c1 - c0 );
+        crop.rows = ( r1 - r0 );
+        fitLayers = false;
+    }
+
+    std::unique_ptr<StepperMotor> fork( const bool& dry ) override {
+        return std::unique_ptr<StepperMotor>( new MatrixMotor( *this, dry ) );
+    }
+
+    MotionState state() const override { return *this; }
+
+    void resume( const MotionState& st ) override {
+        static_cast<MotionState&>( *this ) = st;
+        resumed = true;
+    }
+
+    void endShard( const float& z ) override {
+        saveLayer( z );
+    }
+
+    /** @brief Слои в архиве и слои с подобранной областью (их область известна только из layers.csv
+     *         последнего разбора) выборочно не пересчитываются
+     * */
+    std::string layerHashPath() const override {
+        if( options.archive || options.crop )
+            return "";
+        return ( options.outputDir + "/layers.hash" );
+    }
+
+    uint64_t outputKey() const override {
+        std::ostringstream key;
+        key << options.machine.side() << ',' << extension << ',' << int( options.encoder.format ) << ','
+            << options.encoder.quality << ',' << options.encoder.fastDct << ',' << options.capsule << ','
+            << options.antialias << ',' << options.filament << ',' << options.layerHeight;
+        for( const size_t& scale : options.mips )
+            key << ",mip" << scale;
+        if( ppm != PIXELS_PER_MM )
+            key << ",ppm" << ppm;
+        return fnv1a64( key.str() );
+    }
+
+    bool hasLayer( const size_t& i, const float& z ) const override {
+        struct stat st;
+        return ( ( stat( layerPath( i, z ).c_str(), &st ) == 0 ) && S_ISREG(st.st_mode) );
+    }
+
+    /** @brief Слой и его миниатюры: миниатюры ищутся по имени, прошлый разбор мог строить другие уменьшения
+     * */
+    void removeLayer( const size_t& i, const float& z ) override {
+        const std::filesystem::path path( layerPath( i, z ) );
+        const std::string prefix = ( path.stem().string() + ".mip" );
+        std::error_code ec;
+        std::filesystem::remove( path, ec );
+        for( const auto& item : std::filesystem::directory_iterator( options.outputDir, ec ) ) {
+            const std::string name = item.path().filename().string();
+            if( ( name.compare( 0, prefix.size(), prefix ) == 0 ) && ( item.path().extension() == path.extension() ) )
+                std::filesystem::remove( item.path(), ec );
+        }
+    }
+
+    void flush() override {
+        writer->wait();
+        sink->finish();
+        if( options.crop && !options.archive )
+            saveIndex();
+    }
+};
+
+/** @brief Файл списков отрезков layers.gsl: заголовок, записи слоев, индекс слоев и концевик, как в архиве слоев.
+ *         Запись слоя: начальная точка X, Y и E, затем для каждого перемещения байт флагов и приращения
+ *         от конца предыдущего перемещения. Целые со знаком пишутся zigzag-varint, поэтому короткое
+ *         перемещение занимает 3-5 байт
+ * */
+struct SegmentListHeader {
+    static constexpr uint32_t MAGIC = 0x314c5347;  // "GSL1"
+    static constexpr uint32_t VERSION = 1;
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t xyScale;  // единиц X и Y в мм
+    uint32_t eScale;   // единиц E в мм
+};
+static_assert( sizeof(SegmentListHeader) == 16, "SegmentListHeader должен иметь фиксированный размер" );
+
+struct SegmentListEntry {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t segments;
+    float z;           // высота, на которой выполнены перемещения слоя
+    uint32_t layer;
+};
+static_assert( sizeof(SegmentListEntry) == 32, "SegmentListEntry должен иметь фиксированный размер" );
+
+struct SegmentListFooter {
+    static constexpr uint32_t MAGIC = 0x494c5347;  // "GSLI"
+
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t indexOffset;
+    uint64_t count;
+};
+static_assert( sizeof(SegmentListFooter) == 24, "SegmentListFooter должен иметь фиксированный размер" );
+
+/** @brief Перемещение из списка отрезков, координаты в мм
+ * */
+struct SegmentListMove {
+    enum Flag : uint8_t {
+        WORK = 1,  // G1, иначе холостой G0
+        FEED = 2   // за приращениями следует новая подача
+    };
+
+    float x0, y0, x1, y1;
+    float e;       // приращение E, только для WORK
+    uint32_t feed; // мм/мин
+    bool work;
+};
+
+namespace varint {
+    inline void put( std::vector<uint8_t>& out, uint64_t v ) {
+        for( ; v >= 0x80; v >>= 7 )
+            out.push_back( uint8_t( v | 0x80 ) );
+        out.push_back( uint8_t( v ) );
+    }
+
+    inline void putSigned( std::vector<uint8_t>& out, const int64_t& v ) {
+        put( out, ( ( uint64_t( v ) << 1 ) ^ uint64_t( v >> 63 ) ) );
+    }
+
+    /** @exception MatrixException() Данные кончились посреди числа
+     * */
+    inline uint64_t get( const uint8_t*& p, const uint8_t* end ) {
+        uint64_t v = 0;
+        for( int shift = 0; shift < 64; shift += 7 ) {
+            if( p == end )
+                throw MatrixException( "Испорченный список отрезков" );
+            const uint8_t byte = *p++;
+            v |= ( uint64_t( byte & 0x7F ) << shift );
+            if( ( byte & 0x80 ) == 0 )
+                return v;
+        }
+        throw MatrixException( "Испорченный список отрезков" );
+    }
+
+    inline int64_t getSigned( const uint8_t*& p, const uint8_t* end ) {
+        const uint64_t v = get( p, end );
+        return int64_t( ( v >> 1 ) ^ ( ~( v & 1 ) + 1 ) );
+    }
+}
+
+/** @brief Исполнитель, записывающий вместо растра перемещения каждого слоя: X, Y, подачу и E.
+ *         Слои делятся так же, как в MatrixMotor, поэтому номер слоя совпадает с номером его картинки,
+ *         но записывается высота самих перемещений, а перемещения после последней смены слоя попадают
+ *         в последний слой
+ * */
+class SegmentMotor : public StepperMotor {
+public:
+    static constexpr uint32_t XY_SCALE = 100;     // 0.01 мм
+    static constexpr uint32_t E_SCALE = 100000;   // 0.00001 мм, как пишут слайсеры
+
+private:
+    std::string path;
+    std::ofstream out;
+    uint64_t end;
+    std::vector<SegmentListEntry> index;
+    std::vector<uint8_t> layer;
+    uint64_t segments = 0;
+    int64_t x = 0, y = 0, e = 0;
+    uint32_t feed = 0;
+    float z = 0;
+    bool isWork = true;
+    bool finished = false;
+
+    void beginLayer() {
+        layer.clear();
+        segments = 0;
+        varint::putSigned( layer, x );
+        varint::putSigned( layer, y );
+        varint::putSigned( layer, e );
+    }
+
+    void saveLayer() {
+        SegmentListEntry entry{};
+        entry.offset = end;
+        entry.size = layer.size();
+        entry.segments = segments;
+        entry.z = z;
+        entry.layer = uint32_t( index.size() );
+        if( !out.write( reinterpret_cast<const char*>( layer.data() ), std::streamsize( layer.size() ) ) )
+            throw MatrixException( "Ошибка записи файла: " + path );
+        end += layer.size();
+        index.push_back( entry );
+        PROFILE_COUNT( LAYERS, 1 );
+        PROFILE_COUNT( SEGMENTS, segments );
+        PROFILE_COUNT( BYTES, layer.size() );
+    }
+
+    void go( const MoveRecord& r ) {
+        if( !isWork )
+            return;
+        const bool work = r.work;
+        if( r.has( MoveRecord::Z ) ) {
+            saveLayer();
+            z = fixedToFloat( r.z );
+            beginLayer();
+        }
+        const int64_t nx = ( r.has( MoveRecord::X ) ? fixedTo( r.x, XY_SCALE ) : x );
+        const int64_t ny = ( r.has( MoveRecord::Y ) ? fixedTo( r.y, XY_SCALE ) : y );
+        const int64_t ne = ( ( work && r.has( MoveRecord::E ) ) ? fixedTo( r.e, E_SCALE ) : e );
+        const bool feedChanged = ( r.has( MoveRecord::F ) && ( r.f != 0 ) && ( r.f != feed ) );
+        if( ( nx == x ) && ( ny == y ) && ( ne == e ) && !feedChanged )
+            return;
+        layer.push_back( uint8_t( ( work ? SegmentListMove::WORK : 0 ) | ( feedChanged ? SegmentListMove::FEED : 0 ) ) );
+        varint::putSigned( layer, ( nx - x ) );
+        varint::putSigned( layer, ( ny - y ) );
+        if( work )
+            varint::putSigned( layer, ( ne - e ) );
+        if( feedChanged ) {
+            feed = r.f;
+            varint::put( layer, feed );
+        }
+        x = nx;
+        y = ny;
+        e = ne;
+        ++segments;
+    }
+
+public:
+    /** @param fileName Файл списка отрезков, перезаписывается
+     * */
+    explicit SegmentMotor( const std::string& fileName ) : path(fileName), end( sizeof(SegmentListHeader) ) {
+        out.open( path, ( std::ios::binary | std::ios::trunc ) );
+        if( !out )
+            throw MatrixException( "Не удалось открыть файл: " + path );
+        SegmentListHeader header{};
+        header.magic = SegmentListHeader::MAGIC;
+        header.version = SegmentListHeader::VERSION;
+        header.xyScale = XY_SCALE;
+        header.eScale = E_SCALE;
+        out.write( reinterpret_cast<const char*>( &header ), sizeof(header) );
+        beginLayer();
+    }
+
+    void applyMoves( std::span<const MoveRecord> moves ) override {
+        for( const MoveRecord& r : moves )
+            go( r );
+    }
+
+    void moveE( const Axes& ax ) override { go( MoveRecord::fromAxes( ax, true ) ); }
+    void move( const Axes& ax ) override { go( MoveRecord::fromAxes( ax, false ) ); }
+    void setting( const Axes& ax ) override {}
+
+    void on() override {
+        isWork = true;
+        LOG( INFO, "motors", "---> Моторы включены" );
+    }
+
+    void off() override {
+        isWork = false;
+        LOG( INFO, "motors", "---> Моторы отключены" );
+    }
+
+    void relativeAxes() override {
+        LOG( INFO, "axes", "---> Установлены относительные координаты" );
+    }
+
+    void absoluteAxes() override {
+        LOG( INFO, "axes", "---> Установлены абсолютные координаты" );
+    }
+
+    void resetExtruder( const float& pos ) override {
+        e = fixedTo( toFixed( pos ), E_SCALE );
+    }
+
+    /** @brief Записать последний слой, индекс и концевик
+     *  @exception MatrixException() Ошибка записи
+     * */
+    void flush() override {
+        if( std::exchange( finished, true ) )
+            return;
+        if( segments != 0 )
+            saveLayer();
+        SegmentListFooter footer{};
+        footer.magic = SegmentListFooter::MAGIC;
+        footer.indexOffset = end;
+        footer.count = index.size();
+        out.write( reinterpret_cast<const char*>( index.data() ), std::streamsize( index.size() * sizeof(SegmentListEntry) ) );
+        out.write( reinterpret_cast<const char*>( &footer ), sizeof(footer) );
+        out.flush();
+        if( !out )
+            throw MatrixException( "Ошибка записи файла: " + path );
+        LOG( INFO, "segments", "Записано слоев: " << index.size() << ", " << ( end + sizeof(footer) +
+            index.size() * sizeof(SegmentListEntry) ) << " байт: " << path );
+    }
+};
+
+/** @brief Чтение layers.gsl: индекс читается сразу, слои - по запросу
+ * */
+class SegmentListReader {
+    std::string path;
+    std::vector<uint8_t> data;
+    SegmentListHeader header;
+    std::vector<SegmentListEntry> index;
+
+public:
+    /** @exception MatrixException() Файл не открылся или это не завершенный список отрезков
+     * */
+    explicit SegmentListReader( const std::string& fileName ) : path(fileName) {
+        std::ifstream in( path, std::ios::binary );
+        if( !in )
+            throw MatrixException( "Не удалось открыть файл: " + path );
+        data.assign( std::istreambuf_iterator<char>( in ), std::istreambuf_iterator<char>() );
+        SegmentListFooter footer;
+        if( data.size() < ( sizeof(header) + sizeof(footer) ) )
+            throw MatrixException( "Испорченный список отрезков: " + path );
+        std::memcpy( &header, data.data(), sizeof(header) );
+        std::memcpy( &footer, ( data.data() + data.size() - sizeof(footer) ), sizeof(footer) );
+        if( ( header.magic != SegmentListHeader::MAGIC ) || ( header.version != SegmentListHeader::VERSION ) ||
+                ( footer.magic != SegmentListFooter::MAGIC ) || ( ( footer.indexOffset +
+                footer.count * sizeof(SegmentListEntry) + sizeof(footer) ) != data.size() ) )
+            throw MatrixException( "Испорченный список отрезков: " + path );
+        index.resize( footer.count );
+        std::memcpy( index.data(), ( data.data() + footer.indexOffset ), ( index.size() * sizeof(SegmentListEntry) ) );
+        for( const SegmentListEntry& e : index )
+            if( ( e.offset + e.size ) > footer.indexOffset )
+                throw MatrixException( "Испорченный список отрезков: " + path );
+    }
+
+    size_t size() const noexcept { return index.size(); }
+    const SegmentListEntry& entry( const size_t& i ) const { return index.at( i ); }
+
+    /** @brief Разобрать слой i, visit( const SegmentListMove& ) вызывается для каждого перемещения
+     *  @exception MatrixException() Испорченная запись слоя
+     * */
+    template<typename Visit>
+    void read( const size_t& i, Visit&& visit ) const {
+        const SegmentListEntry& e = entry( i );
+        const uint8_t* p = ( data.data() + e.offset );
+        const uint8_t* last = ( p + e.size );
+        int64_t x = varint::getSigned( p, last );
+        int64_t y = varint::getSigned( p, last );
+        varint::getSigned( p, last );
+        uint32_t feed = 0;
+        for( uint64_t k = 0; k < e.segments; ++k ) {
+            if( p == last )
+                throw MatrixException( "Испорченный список отрезков: " + path );
+            const uint8_t flags = *p++;
+            SegmentListMove move;
+            move.work = ( flags & SegmentListMove::WORK );
+            move.x0 = ( float( x ) / header.xyScale );
+            move.y0 = ( float( y ) / header.xyScale );
+            x += varint::getSigned( p, last );
+            y += varint::getSigned( p, last );
+            move.e = ( move.work ? ( float( varint::getSigned( p, last ) ) / header.eScale ) : 0.0f );
+            if( flags & SegmentListMove::FEED )
+                feed = uint32_t( varint::get( p, last ) );
+            move.x1 = ( float( x ) / header.xyScale );
+            move.y1 = ( float( y ) / header.xyScale );
+            move.feed = feed;
+            visit( move );
+        }
+    }
+};
+
+struct StepperSimulatorOptions {
+    std::array<int64_t, 4> stepsPerMm = MachineProfile().stepsPerMm();  // X и Y по умолчанию 80
+    float feedrate = 1500;  // мм/мин до первого F
+};
+
+/** @brief Генератор шагов многоосевым DDA (Брезенхэм по числу шагов ведущей оси), как в прошивке.
+ *         Блок - одно движение: целые числа шагов по осям и число событий, равное шагам ведущей оси.
+ *         Внутренний цикл только целочисленный, события пишутся пачками масок осей в буфер и
+ *         передаются потребителю целой пачкой
+ * */
+class StepGenerator {
+public:
+    static constexpr size_t AXES = 4;
+    static constexpr size_t BATCH = 4096;
+
+    /** @brief Потребитель пачек событий: бит a маски - шаг оси a, бит ( a + 4 ) - направление назад
+     * */
+    using Consumer = std::function<void( const uint8_t* masks, const size_t& size )>;
+
+    struct Block {
+        std::array<int64_t, AXES> steps{};  // со знаком направления
+        uint64_t events = 0;                // шагов ведущей оси
+    };
+
+    /** @brief Минимальный промежуток между шагами оси внутри блока в событиях
+     * */
+    using Gaps = std::array<uint64_t, AXES>;
+
+    explicit StepGenerator( Consumer consumer = nullptr ) : consumer( std::move( consumer ) ) {}
+
+    static Block makeBlock( const std::array<int64_t, AXES>& delta ) noexcept {
+        Block block;
+        block.steps = delta;
+        for( const int64_t& d : delta )
+            block.events = std::max<uint64_t>( block.events, uint64_t( ( d < 0 ) ? -d : d ) );
+        return block;
+    }
+
+    /** @brief Выполнить блок
+     *  @param done Шагов, сделанных каждой осью
+     *  @param gaps Минимальные промежутки между соседними шагами оси, 0 - меньше двух шагов
+     * */
+    void run( const Block& block, std::array<uint64_t, AXES>& done, Gaps& gaps ) {
+        std::array<uint64_t, AXES> count{};
+        std::array<int64_t, AXES> error{};
+        std::array<uint64_t, AXES> last{};
+        uint8_t direction = 0;
+        for( size_t a = 0; a < AXES; ++a ) {
+            count[a] = uint64_t( ( block.steps[a] < 0 ) ? -block.steps[a] : block.steps[a] );
+            error[a] = -int64_t( block.events >> 1 );
+            direction |= uint8_t( ( block.steps[a] < 0 ) << ( a + 4 ) );
+            gaps[a] = 0;
+            done[a] = 0;
+        }
+        const int64_t events = int64_t( block.events );
+        for( uint64_t e = 0; e < block.events; ++e ) {
+            uint8_t mask = direction;
+            for( size_t a = 0; a < AXES; ++a ) {
+                error[a] += int64_t( count[a] );
+                if( error[a] > 0 ) {
+                    error[a] -= events;
+                    mask |= uint8_t( 1 << a );
+                    if( done[a] != 0 )
+                        gaps[a] = ( ( gaps[a] == 0 ) ? ( e - last[a] ) : std::min( gaps[a], ( e - last[a] ) ) );
+                    last[a] = e;
+                    ++done[a];
+                }
+            }
+            if( consumer ) {
+                batch[used++] = mask;
+                if( used == BATCH )
+                    flush();
+            }
+        }
+    }
+
+    /** @brief Передать потребителю неполную пачку
+     * */
+    void flush() {
+        if( consumer && ( used != 0 ) )
+            consumer( batch.data(), used );
+        used = 0;
+    }
+
+private:
+    Consumer consumer;
+    std::array<uint8_t, BATCH> batch{};
+    size_t used = 0;
+};
+
+/** @brief Моделирование на уровне шагов двигателей: каждое движение переводится в целые шаги осей
+ *         и проходит через StepGenerator. Скорость постоянна в пределах движения и равна F, поэтому
+ *         частота событий блока равна events / время движения. Отчет в flush(): шаги, время и пиковая
+ *         частота шагов по каждой оси
+ * */
+class StepperSimulator : public StepperMotor {
+    static constexpr const char* NAMES = "XYZE";
+
+    StepperSimulatorOptions options;
+    StepGenerator generator;
+    std::array<int64_t, StepGenerator::AXES> position{};  // в шагах
+    std::array<Fixed, StepGenerator::AXES> place{};       // то же положение в мм: от него считаются шаги при G91
+    std::array<uint64_t, StepGenerator::AXES> totals{};
+    std::array<double, StepGenerator::AXES> peaks{};      // шагов в секунду
+    double feedrate;                                      // мм/мин
+    double seconds = 0;
+    uint64_t events = 0;
+    uint64_t blocks = 0;
+    bool relative = false;
+    bool isWork = true;
+
+    /** @brief Шаги из Fixed с округлением половины от нуля
+     * */
+    int64_t toSteps( const size_t& axis, const Fixed& mm ) const noexcept {
+        const Fixed n = ( mm * options.stepsPerMm[axis] );
+        return ( ( n >= 0 ) ? ( ( n + FIXED_SCALE / 2 ) / FIXED_SCALE ) : -( ( -n + FIXED_SCALE / 2 ) / FIXED_SCALE ) );
+    }
+
+    /** @brief Движение к словам, заданным в r.present; при G91 слова прибавляются к положению в мм,
+     *         а не к уже округленным шагам, поэтому мелкие шаги хорд не накапливают ошибку
+     * */
+    void go( const MoveRecord& r ) {
+        if( !isWork )
+            return;
+        if( r.has( MoveRecord::F ) && ( r.f != 0 ) )
+            feedrate = r.f;
+        static constexpr MoveRecord::Axis MASKS[StepGenerator::AXES] = { MoveRecord::X, MoveRecord::Y, MoveRecord::Z,
+            MoveRecord::E };
+        const Fixed values[StepGenerator::AXES] = { r.x, r.y, r.z, r.e };
+        std::array<int64_t, StepGenerator::AXES> delta{};
+        double length = 0;
+        for( size_t a = 0; a < StepGenerator::AXES; ++a ) {
+            if( !r.has( MASKS[a] ) )
+                continue;
+            place[a] = ( relative ? ( place[a] + values[a] ) : values[a] );
+            const int64_t target = toSteps( a, place[a] );
+            delta[a] = ( target - position[a] );
+            position[a] = target;
+            const double mm = ( double( delta[a] ) / options.stepsPerMm[a] );
+            if( a < 3 )
+                length += ( mm * mm );
+        }
+        // Движение только экструдером идет со скоростью F по прутку
+        length = ( ( length > 0 ) ? std::sqrt( length ) : std::fabs( double( delta[3] ) / options.stepsPerMm[3] ) );
+        const StepGenerator::Block block = StepGenerator::makeBlock( delta );
+        if( ( block.events == 0 ) || ( feedrate <= 0 ) )
+            return;
+        std::array<uint64_t, StepGenerator::AXES> done;
+        StepGenerator::Gaps gaps;
+        generator.run( block, done, gaps );
+        const double duration = ( length * 60 / feedrate );
+        const double eventRate = ( block.events / duration );
+        for( size_t a = 0; a < StepGenerator::AXES; ++a ) {
+            totals[a] += done[a];
+            if( done[a] != 0 )
+                peaks[a] = std::max( peaks[a], ( ( gaps[a] == 0 ) ? ( done[a] / duration ) : ( eventRate / gaps[a] ) ) );
+        }
+        seconds += duration;
+        events += block.events;
+        ++blocks;
+    }
+
+public:
+    explicit StepperSimulator( const StepperSimulatorOptions& opts = StepperSimulatorOptions(),
+            StepGenerator::Consumer consumer = nullptr ) : options(opts), generator( std::move( consumer ) ),
+            feedrate(opts.feedrate) {}
+
+    void applyMoves( std::span<const MoveRecord> moves ) override {
+        for( const MoveRecord& r : moves )
+            go( r );
+    }
+
+    void moveE( const Axes& ax ) override { go( MoveRecord::fromAxes( ax, true ) ); }
+    void move( const Axes& ax ) override { go( MoveRecord::fromAxes( ax, false ) ); }
+
+    /** @brief G92 с указанными осями задает текущую позицию без движения
+     * */
+    void setting( const Axes& ax ) override {
+        const float values[StepGenerator::AXES] = { ax._x, ax._y, ax._z, ax._e };
+        for( size_t a = 0; a < StepGenerator::AXES; ++a )
+            if( values[a] != 0 ) {
+                place[a] = toFixed( values[a] );
+                position[a] = toSteps( a, place[a] );
+            }
+    }
+
+    void resetExtruder( const float& e ) override {
+        place[3] = toFixed( e );
+        position[3] = toSteps( 3, place[3] );
+    }
+
+    void on() override { isWork = true; }
+    void off() override { isWork = false; }
+    void relativeAxes() override { relative = true; }
+    void absoluteAxes() override { relative = false; }
+
+    uint64_t steps( const size_t& axis ) const { return totals.at( axis ); }
+    double peakRate( const size_t& axis ) const { return peaks.at( axis ); }
+    double printSeconds() const noexcept { return seconds; }
+
+    void flush() override {
+        generator.flush();
+        LOG( INFO, "steps", "---> Шаговое моделирование: блоков " << blocks << ", событий " << events << ", время "
+             << std::fixed << std::setprecision(1) << seconds << " с" );
+        for( size_t a = 0; a < StepGenerator::AXES; ++a )
+            LOG( INFO, "steps", "     " << NAMES[a] << ": шагов " << totals[a] << ", пик " << std::fixed
+                 << std::setprecision(0) << peaks[a] << " шаг/с" );
+    }
+};
+
+struct PlannerOptions {
+    size_t blocks = 16;                 // блоков в буфере просмотра вперед
+    double acceleration = 500;          // мм/с^2
+    double junctionDeviation = 0.013;   // мм
+    double minimumSpeed = 0.05;         // мм/с, скорость на резком развороте
+    float feedrate = 1500;              // мм/мин до первого F
+    std::string report;                 // CSV времени слоев layer,z,seconds, пустая строка - не писать
+};
+
+/** @brief Планировщик движения по образцу Marlin: стоит между Arbitr и StepperMotor, передает все
+ *         команды дальше без изменений и считает реальное время печати. Движения собираются в кольцевой
+ *         буфер блоков, скорость на стыке ограничивается отклонением стыка (junction deviation), затем
+ *         проходы назад и вперед задают скорости входа, а время блока считается по трапеции разгона и
+ *         торможения. Проход назад идет от нового блока и останавливается на первом блоке, чья
+ *         скорость не изменилась, проход вперед - от него до конца, так что на каждый блок
+ *         пересчитывается только затронутый хвост буфера. Старейший блок выталкивается из полного
+ *         буфера, его время добавляется к слою и к общему времени
+ * */
+class MotionPlanner : public StepperMotor {
+    static constexpr size_t AXES = 4;
+
+    struct Block {
+        double length = 0;    // мм
+        double nominal = 0;   // мм/с
+        double maxEntry = 0;  // предел скорости входа по стыку и скоростям соседних блоков
+        double reverse = 0;   // предел входа из прохода назад
+        double entry = 0;     // итоговая скорость входа
+        size_t layer = 0;
+    };
+
+    StepperMotor* next;
+    PlannerOptions options;
+    std::vector<Block> ring;
+    size_t head = 0;  // старейший блок
+    size_t count = 0;
+    std::array<double, AXES> position{};
+    std::array<double, AXES> unit{};  // направление последнего движения
+    double lastNominal = 0;
+    bool hasLast = false;
+    double feedrate;
+    bool relative = false;
+    bool isWork = true;
+    size_t layer = 0;
+    std::vector<double> layerTimes;   // последний элемент - хвост после последней смены слоя
+    std::vector<float> layerZ;        // Z строки, завершившей слой
+    double total = 0;
+    SlicerHeader slicer;
+
+    Block& at( const size_t& i ) { return ring[( ( head + i ) % ring.size() )]; }
+
+    /** @brief Время движения по трапеции со входом v0, выходом v1 и крейсерской скоростью vn
+     * */
+    double trapezoid( const Block& b, const double& v1 ) const {
+        const double a = options.acceleration;
+        const double v0 = b.entry;
+        const double accel = ( ( b.nominal * b.nominal - v0 * v0 ) / ( 2 * a ) );
+        const double decel = ( ( b.nominal * b.nominal - v1 * v1 ) / ( 2 * a ) );
+        if( ( accel + decel ) <= b.length )
+            return ( ( b.nominal - v0 ) / a + ( b.nominal - v1 ) / a + ( b.length - accel - decel ) / b.nominal );
+        const double peak = std::sqrt( std::max( ( ( 2 * a * b.length + v0 * v0 + v1 * v1 ) / 2 ),
+            std::max( ( v0 * v0 ), ( v1 * v1 ) ) ) );
+        return ( ( peak - v0 ) / a + ( peak - v1 ) / a );
+    }
+
+    void retire( const double& exit ) {
+        const Block& b = at( 0 );
+        const double t = trapezoid( b, exit );
+        if( layerTimes.size() <= b.layer )
+            layerTimes.resize( ( b.layer + 1 ), 0 );
+        layerTimes[b.layer] += t;
+        total += t;
+        head = ( ( head + 1 ) % ring.size() );
+        --count;
+    }
+
+    /** @brief Пересчитать скорости входа после добавления блока в конец. Вход старейшего блока
+     *         зафиксирован выходом уже вытолкнутого
+     * */
+    void recalculate() {
+        const double twoA = ( 2 * options.acceleration );
+        size_t first = ( count - 1 );
+        Block& last = at( first );
+        last.reverse = std::min( last.maxEntry, std::sqrt( twoA * last.length ) );
+        while( first > 1 ) {
+            Block& b = at( ( first - 1 ) );
+            const double v = std::min( b.maxEntry, std::sqrt( ( at( first ).reverse * at( first ).reverse +
+                twoA * b.length ) ) );
+            if( v == b.reverse )
+                break;
+            b.reverse = v;
+            --first;
+        }
+        for( size_t i = std::max<size_t>( first, 1 ); i < count; ++i ) {
+            const Block& prev = at( ( i - 1 ) );
+            Block& b = at( i );
+            b.entry = std::min( b.reverse, std::sqrt( ( prev.entry * prev.entry + twoA * prev.length ) ) );
+        }
+    }
+
+    /** @brief Блок движения к словам, заданным в r.present: явный X0 или E0 - это движение, а не пропуск
+     * */
+    void plan( const MoveRecord& r ) {
+        if( r.has( MoveRecord::F ) && ( r.f != 0 ) )
+            feedrate = r.f;
+        // слои нумеруются как в MatrixMotor: каждое слово Z при включенных моторах завершает слой,
+        // само движение со сменой слоя относится уже к следующему
+        if( r.has( MoveRecord::Z ) && isWork ) {
+            layerZ.push_back( fixedToFloat( r.z ) );
+            layer = layerZ.size();
+        }
+        static constexpr MoveRecord::Axis MASKS[AXES] = { MoveRecord::X, MoveRecord::Y, MoveRecord::Z, MoveRecord::E };
+        const Fixed values[AXES] = { r.x, r.y, r.z, r.e };
+        std::array<double, AXES> delta{};
+        for( size_t a = 0; a < AXES; ++a ) {
+            if( !r.has( MASKS[a] ) )
+                continue;
+            const double value = ( double( values[a] ) / FIXED_SCALE );
+            const double target = ( relative ? ( position[a] + value ) : value );
+            delta[a] = ( target - position[a] );
+            position[a] = target;
+        }
+        double length = std::sqrt( ( delta[0] * delta[0] + delta[1] * delta[1] + delta[2] * delta[2] ) );
+        std::array<double, AXES> direction{};
+        if( length > 1e-6 ) {
+            for( size_t a = 0; a < 3; ++a )
+                direction[a] = ( delta[a] / length );
+        } else {
+            length = std::fabs( delta[3] );
+            if( length <= 1e-6 )
+                return;
+            direction[3] = ( ( delta[3] < 0 ) ? -1 : 1 );
+        }
+        if( layerTimes.size() <= layer )
+            layerTimes.resize( ( layer + 1 ), 0 );
+
+        Block b;
+        b.length = length;
+        b.nominal = std::max( ( feedrate / 60.0 ), options.minimumSpeed );
+        b.layer = layer;
+        if( hasLast ) {
+            double cosTheta = 0;
+            for( size_t a = 0; a < AXES; ++a )
+                cosTheta -= ( unit[a] * direction[a] );
+            double junction = options.minimumSpeed;
+            if( cosTheta < 0.999999 ) {
+                const double sinHalf = std::sqrt( ( 0.5 * ( 1 - std::max( cosTheta, -0.999999 ) ) ) );
+                junction = std::max( junction, std::sqrt( ( options.acceleration * options.junctionDeviation *
+                    sinHalf / ( 1 - sinHalf ) ) ) );
+            }
+            b.maxEntry = std::min( { junction, b.nominal, lastNominal } );
+        }
+        unit = direction;
+        lastNominal = b.nominal;
+        hasLast = true;
+
+        if( count == ring.size() )
+            retire( at( 1 ).entry );
+        at( count++ ) = b;
+        recalculate();
+    }
+
+public:
+    /** @param next Мотор, которому передаются все команды
+     * */
+    explicit MotionPlanner( StepperMotor* next, const PlannerOptions& opts = PlannerOptions() ) : next(next),
+            options(opts), ring( std::max<size_t>( opts.blocks, 2 ) ), feedrate(opts.feedrate) {}
+
+    void moveE( const Axes& ax ) override {
+        plan( MoveRecord::fromAxes( ax, true ) );
+        next->moveE( ax );
+    }
+
+    void move( const Axes& ax ) override {
+        plan( MoveRecord::fromAxes( ax, false ) );
+        next->move( ax );
+    }
+
+    void applyMoves( std::span<const MoveRecord> moves ) override {
+        for( const MoveRecord& r : moves )
+            plan( r );
+        next->applyMoves( moves );
+    }
+
+    void setting( const Axes& ax ) override {
+        const float values[AXES] = { ax._x, ax._y, ax._z, ax._e };
+        for( size_t a = 0; a < AXES; ++a )
+            if( values[a] != 0 )
+                position[a] = values[a];
+        next->setting( ax );
+    }
+
+    void resetExtruder( const float& e ) override {
+        position[3] = e;
+        next->resetExtruder( e );
+    }
+
+    void on() override {
+        isWork = true;
+        next->on();
+    }
+
+    void off() override {
+        isWork = false;
+        next->off();
+    }
+
+    void relativeAxes() override {
+        relative = true;
+        next->relativeAxes();
+    }
+
+    void absoluteAxes() override {
+        relative = false;
+        next->absoluteAxes();
+    }
+
+    void header( const SlicerHeader& hdr ) override {
+        slicer = hdr;
+        next->header( hdr );
+    }
+
+    /** @brief Время слоя i в секундах; номер i у того же слоя в MatrixMotor
+     * */
+    double layerSeconds( const size_t& i ) const { return ( ( i < layerTimes.size() ) ? layerTimes[i] : 0.0 ); }
+    size_t layers() const noexcept { return layerZ.size(); }
+    double seconds() const noexcept { return total; }
+
+    /** @brief Время каждого слоя в options.report
+     *  @exception MatrixException() Ошибка записи
+     * */
+    void saveReport() const {
+        std::ofstream csv( options.report, std::ios::trunc );
+        if( !csv )
+            throw MatrixException( "Не удалось открыть файл: " + options.report );
+        csv << "layer,z,seconds\n" << std::fixed;
+        for( size_t i = 0; i < layerZ.size(); ++i )
+            csv << i << ',' << std::setprecision(2) << layerZ[i] << ',' << std::setprecision(3) << layerSeconds( i )
+                << '\n';
+        if( !csv )
+            throw MatrixException( "Ошибка записи файла: " + options.report );
+    }
+
+    /** @brief Дотормозить буфер до остановки, вывести оценку времени и записать время слоев
+     * */
+    void flush() override {
+        while( count > 1 )
+            retire( at( 1 ).entry );
+        if( count == 1 )
+            retire( 0 );
+        hasLast = false;
+        std::ostringstream estimate;
+        if( slicer.fields & SlicerHeader::TIME )
+            estimate << ", оценка слайсера " << std::fixed << std::setprecision(1) << slicer.time << " с ("
+                     << std::showpos << ( ( slicer.time > 0 ) ? ( ( total / slicer.time - 1 ) * 100 ) : 0 ) << "%)";
+        LOG( INFO, "planner", "---> Планировщик: время печати " << std::fixed << std::setprecision(1) << total
+             << " с, слоев " << layers() << ", после последнего слоя " << layerSeconds( layers() ) << " с"
+             << estimate.str() );
+        for( size_t i = 0; i < layers(); ++i )
+            LOG( DEBUG, "planner", "     слой " << i << " Z" << layerZ[i] << ": " << std::fixed << std::setprecision(1)
+                 << layerSeconds( i ) << " с" );
+        if( !options.report.empty() )
+            saveReport();
+        next->flush();
+    }
+};
+
+struct TeeOptions {
+    bool threaded = false;  // каждый исполнитель в своем потоке
+    size_t batch = 1024;    // команд в пачке очереди
+    size_t depth = 8;       // пачек в очереди исполнителя, дальше разбор ждет
+};
+
+/** @brief Разветвитель: каждая команда передается всем исполнителям, поэтому растр, оценка времени и
+ *         список отрезков получаются за один разбор. С threaded команды собираются в пачки, одна пачка
+ *         общая для всех очередей, и каждый исполнитель разбирает свою очередь в своем потоке: медленный
+ *         исполнитель задерживает разбор, только когда его очередь заполнена. Ошибка исполнителя
+ *         сохраняется, его следующие команды пропускаются, а ошибка выбрасывается из flush()
+ * */
+class TeeMotor : public StepperMotor {
+    struct Event {
+        enum Kind : uint8_t { MOVE_E, MOVE, SETTING, ON, OFF, RELATIVE, ABSOLUTE, HEADER, RESET_EXTRUDER, RECORDS };
+
+        Kind kind;
+        Axes ax;             // для RESET_EXTRUDER позиция в ax._e
+        uint32_t first = 0;  // RECORDS: перемещения [first, first + count) из Pack::records
+        uint32_t count = 0;
+    };
+
+    /** @brief Пачка команд: подряд идущие перемещения лежат в records и передаются исполнителю
+     *         одним applyMoves(), как без потоков
+     * */
+    struct Pack {
+        std::vector<Event> events;
+        std::vector<MoveRecord> records;
+    };
+    using Batch = std::shared_ptr<const Pack>;
+
+    struct Lane {
+        StepperMotor* motor;
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::deque<Batch> queue;
+        bool busy = false;
+        bool stop = false;
+        std::exception_ptr error;
+    };
+
+    std::vector<std::unique_ptr<StepperMotor>> motors;
+    TeeOptions options;
+    std::vector<std::unique_ptr<Lane>> lanes;
+    Pack current;
+    SlicerHeader slicer;
+
+    static void apply( StepperMotor& motor, const Event& event, const Pack& pack, const SlicerHeader& slicer ) {
+        switch( event.kind ) {
+            case Event::MOVE_E: motor.moveE( event.ax ); break;
+            case Event::MOVE: motor.move( event.ax ); break;
+            case Event::SETTING: motor.setting( event.ax ); break;
+            case Event::ON: motor.on(); break;
+            case Event::OFF: motor.off(); break;
+            case Event::RELATIVE: motor.relativeAxes(); break;
+            case Event::ABSOLUTE: motor.absoluteAxes(); break;
+            case Event::HEADER: motor.header( slicer ); break;
+            case Event::RESET_EXTRUDER: motor.resetExtruder( event.ax._e ); break;
+            case Event::RECORDS:
+                motor.applyMoves( std::span<const MoveRecord>( ( pack.records.data() + event.first ), event.count ) );
+                break;
+        }
+    }
+
+    void work( Lane& lane ) {
+        for( ;; ) {
+            Batch batch;
+            {
+                std::unique_lock<std::mutex> lock( lane.mutex );
+                lane.changed.wait( lock, [&]() { return ( !lane.queue.empty() || lane.stop ); } );
+                if( lane.queue.empty() )
+                    return;
+                batch = std::move( lane.queue.front() );
+                lane.queue.pop_front();
+                lane.busy = true;
+            }
+            lane.changed.notify_all();
+            if( !lane.error ) {
+                try {
+                    for( const Event& event : batch->events )
+                        apply( *lane.motor, event, *batch, slicer );
+                } catch ( ... ) {
+                    lane.error = std::current_exception();
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock( lane.mutex );
+                lane.busy = false;
+            }
+            lane.changed.notify_all();
+        }
+    }
+
+    void publish() {
+        if( current.events.empty() )
+            return;
+        const Batch batch = std::make_shared<const Pack>( std::move( current ) );
+        current = Pack();
+        current.events.reserve( options.batch );
+        current.records.reserve( options.batch );
+        for( const auto& lane : lanes ) {
+            {
+                std::unique_lock<std::mutex> lock( lane->mutex );
+                lane->changed.wait( lock, [&]() { return ( lane->queue.size() < options.depth ); } );
+                lane->queue.push_back( batch );
+            }
+            lane->changed.notify_all();
+        }
+    }
+
+    void send( const Event::Kind& kind, const Axes& ax = Axes() ) {
+        if( lanes.empty() ) {
+            for( const auto& motor : motors )
+                apply( *motor, Event{ kind, ax }, current, slicer );
+            return;
+        }
+        current.events.push_back( Event{ kind, ax } );
+        if( current.events.size() >= options.batch )
+            publish();
+    }
+
+    /** @brief Перемещения дописываются к последнему событию RECORDS, если оно последнее в пачке
+     * */
+    void sendMoves( std::span<const MoveRecord> moves ) {
+        while( !moves.empty() ) {
+            const size_t room = ( ( current.records.size() < options.batch ) ?
+                ( options.batch - current.records.size() ) : 1 );
+            const std::span<const MoveRecord> part = moves.first( std::min( room, moves.size() ) );
+            if( current.events.empty() || ( current.events.back().kind != Event::RECORDS ) )
+                current.events.push_back( Event{ Event::RECORDS, Axes(), uint32_t( current.records.size() ), 0 } );
+            current.records.insert( current.records.end(), part.begin(), part.end() );
+            current.events.back().count += uint32_t( part.size() );
+            moves = moves.subspan( part.size() );
+            if( ( current.records.size() >= options.batch ) || ( current.events.size() >= options.batch ) )
+                publish();
+        }
+    }
+
+    /** @brief Дождаться, пока все очереди опустеют
+     * */
+    void drain() {
+        publish();
+        for( const auto& lane : lanes ) {
+            std::unique_lock<std::mutex> lock( lane->mutex );
+            lane->changed.wait( lock, [&]() { return ( lane->queue.empty() && !lane->busy ); } );
+        }
+    }
+
+public:
+    /** @param backends Исполнители, вызываются в порядке списка
+     * */
+    explicit TeeMotor( std::vector<std::unique_ptr<StepperMotor>> backends, const TeeOptions& opts = TeeOptions() ) :
+            motors( std::move( backends ) ), options(opts) {
+        options.batch = std::max<size_t>( options.batch, 1 );
+        options.depth = std::max<size_t>( options.depth, 1 );
+        if( !options.threaded )
+            return;
+        current.events.reserve( options.batch );
+        current.records.reserve( options.batch );
+        for( const auto& motor : motors ) {
+            lanes.push_back( std::make_unique<Lane>() );
+            lanes.back()->motor = motor.get();
+        }
+        for( const auto& lane : lanes )
+            lane->thread = std::thread( &TeeMotor::work, this, std::ref( *lane ) );
+    }
+
+    TeeMotor( const TeeMotor& ) = delete;
+    TeeMotor& operator=( const TeeMotor& ) = delete;
+
+    ~TeeMotor() {
+        publish();
+        for( const auto& lane : lanes ) {
+            {
+                std::lock_guard<std::mutex> lock( lane->mutex );
+                lane->stop = true;
+            }
+            lane->changed.notify_all();
+        }
+        for( const auto& lane : lanes )
+            lane->thread.join();
+    }
+
+    void moveE( const Axes& ax ) override { send( Event::MOVE_E, ax ); }
+    void move( const Axes& ax ) override { send( Event::MOVE, ax ); }
+
+    void applyMoves( std::span<const MoveRecord> moves ) override {
+        if( lanes.empty() ) {
+            for( const auto& motor : motors )
+                motor->applyMoves( moves );
+            return;
+        }
+        sendMoves( moves );
+    }
+    void setting( const Axes& ax ) override { send( Event::SETTING, ax ); }
+    void on() override { send( Event::ON ); }
+    void off() override { send( Event::OFF ); }
+    void relativeAxes() override { send( Event::RELATIVE ); }
+    void absoluteAxes() override { send( Event::ABSOLUTE ); }
+
+    void resetExtruder( const float& e ) override {
+        send( Event::RESET_EXTRUDER, Axes( 0, 0, 0, e, 0 ) );
+    }
+
+    /** @brief Заголовок приходит до первой команды, потоки читают его копию только после публикации пачки
+     * */
+    void header( const SlicerHeader& hdr ) override {
+        drain();
+        slicer = hdr;
+        send( Event::HEADER );
+    }
+
+    /** @exception Первая ошибка исполнителей по порядку списка, после того как все они закончили работу
+     * */
+    void flush() override {
+        drain();
+        std::exception_ptr error;
+        for( size_t i = 0; i < motors.size(); ++i ) {
+            if( !lanes.empty() && lanes[i]->error ) {
+                if( !error )
+                    error = std::exchange( lanes[i]->error, nullptr );
+                continue;
+            }
+            try {
+                motors[i]->flush();
+            } catch ( ... ) {
+                if( !error )
+                    error = std::current_exception();
+            }
+        }
+        if( error )
+            std::rethrow_exception( error );
+    }
+
+    /** @brief Участки для разбора по слоям: только без потоков и если участки умеют все исполнители
+     * */
+    std::unique_ptr<StepperMotor> fork( const bool& dry ) override {
+        if( !lanes.empty() )
+            return nullptr;
+        std::vector<std::unique_ptr<StepperMotor>> forks;
+        for( const auto& motor : motors ) {
+            forks.push_back( motor->fork( dry ) );
+            if( !forks.back() )
+                return nullptr;
+        }
+        return std::make_unique<TeeMotor>( std::move( forks ) );
+    }
+
+    MotionState state() const override {
+        return ( motors.empty() ? MotionState() : motors.front()->state() );
+    }
+
+    void resume( const MotionState& st ) override {
+        for( const auto& motor : motors )
+            motor->resume( st );
+    }
+
+    void endShard( const float& z ) override {
+        for( const auto& motor : motors )
+            motor->endShard( z );
+    }
+};
+
+/** @brief Источник строк G-code для Arbitr
+ * */
+class InputSource {
+public:
+    virtual ~InputSource() {}
+
+    /** @brief Получить следующую строку без символа '\n'
+     *  @param line Строка, действительна до следующего вызова next()
+     *  @return false, если строки закончились
+     * */
+    virtual bool next( std::string_view& line ) = 0;
+
+    /** @brief Размер входных данных в байтах
+     * */
+    virtual size_t size() const noexcept = 0;
+};
+
+/** @brief Чтение файла через std::ifstream и std::getline
+ * */
+class StreamSource : public InputSource {
+    std::ifstream inFile;
+    std::string buffer;
+    size_t fileSize;
+
+public:
+    explicit StreamSource( const std::string& fileName ) : inFile(fileName), fileSize(0) {
+        if( !inFile )
+            throw FileNotOpen( fileName );
+        inFile.seekg( 0, std::ios::end );
+        fileSize = inFile.tellg();
+        inFile.seekg(0);
+    }
+
+    ~StreamSource() {
+        inFile.close();
+    }
+
+    bool next( std::string_view& line ) override {
+        if( !std::getline( inFile, buffer ) )
+            return false;
+        line = buffer;
+        return true;
+    }
+
+    size_t size() const noexcept override { return fileSize; }
+};
+
+/** @brief Файл, целиком отображенный в память через mmap. Строки отдаются как string_view прямо на
+ *         отображение, без копирования. Ядру сообщается о последовательном чтении (MADV_SEQUENTIAL)
+ * */
+class MappedSource : public InputSource {
+    int fd;
+    const char* data;
+    size_t fileSize;
+    size_t pos;
+
+public:
+    explicit MappedSource( const std::string& fileName ) : fd(-1), data(nullptr), fileSize(0), pos(0) {
+        fd = open( fileName.c_str(), O_RDONLY );
+        struct stat st;
+        if( ( fd < 0 ) || ( fstat( fd, &st ) != 0 ) ) {
+            if( fd >= 0 )
+                close( fd );
+            throw FileNotOpen( fileName );
+        }
+        fileSize = st.st_size;
+        if( fileSize == 0 )
+            return;
+        void* addr = mmap( nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0 );
+        if( addr == MAP_FAILED ) {
+            close( fd );
+            throw FileNotOpen( fileName );
+        }
+        madvise( addr, fileSize, MADV_SEQUENTIAL );
+        madvise( addr, fileSize, MADV_WILLNEED );
+        data = static_cast<const char*>( addr );
+    }
+
+    MappedSource( const MappedSource& ) = delete;
+    MappedSource& operator=( const MappedSource& ) = delete;
+
+    ~MappedSource() {
+        if( data != nullptr )
+            munmap( const_cast<char*>( data ), fileSize );
+        close( fd );
+    }
+
+    bool next( std::string_view& line ) override {
+        if( pos >= fileSize )
+            return false;
+        const char* begin = ( data + pos );
+        const char* nl = static_cast<const char*>( std::memchr( begin, '\n', ( fileSize - pos ) ) );
+        const size_t length = ( ( nl != nullptr ) ? size_t( nl - begin ) : ( fileSize - pos ) );
+        line = std::string_view( begin, length );
+        pos += ( length + 1 );
+        return true;
+    }
+
+    size_t size() const noexcept override { return fileSize; }
+
+    /** @brief Все отображенное содержимое файла
+     * */
+    std::string_view view() const noexcept { return std::string_view( data, fileSize ); }
+};
+
+/** @brief Строки из потока без размера и перемотки: stdin или соединение TCP от программы-отправителя
+ *         (как OctoPrint). Буфер ограничен CAPACITY байт, строка отдается, как только пришел ее '\n'.
+ *         С ack после выполнения каждой строки, то есть при запросе следующей, отправителю пишется "ok"
+ * */
+class DescriptorSource : public InputSource {
+public:
+    static constexpr size_t CAPACITY = ( size_t(1) << 16 );
+
+private:
+    int fd;
+    bool owned;
+    bool ack;
+    bool pending = false;  // прочитанная строка ждет подтверждения
+    bool eof = false;
+    std::vector<char> buffer;
+    size_t begin = 0;
+    size_t end = 0;
+    size_t received = 0;
+
+    void reply() {
+        static constexpr char OK[] = "ok\n";
+        if( !std::exchange( pending, false ) || !ack )
+            return;
+        for( size_t done = 0; done < ( sizeof(OK) - 1 ); ) {
+            const ssize_t n = ::write( fd, ( OK + done ), ( sizeof(OK) - 1 - done ) );
+            if( ( n < 0 ) && ( errno == EINTR ) )
+                continue;
+            if( n <= 0 )
+                return;
+            done += size_t( n );
+        }
+    }
+
+    bool fill() {
+        if( begin != 0 ) {
+            std::memmove( buffer.data(), ( buffer.data() + begin ), ( end - begin ) );
+            end -= begin;
+            begin = 0;
+        }
+        while( !eof ) {
+            const ssize_t n = ::read( fd, ( buffer.data() + end ), ( buffer.size() - end ) );
+            if( ( n < 0 ) && ( errno == EINTR ) )
+                continue;
+            if( n <= 0 ) {
+                eof = true;
+                break;
+            }
+            end += size_t( n );
+            received += size_t( n );
+            return true;
+        }
+        return false;
+    }
+
+public:
+    /** @param fd Открытый дескриптор
+     *  @param owned Закрыть дескриптор в деструкторе
+     *  @param ack Отвечать "ok" на каждую строку
+     * */
+    DescriptorSource( const int& fd, const bool& owned, const bool& ack ) : fd(fd), owned(owned), ack(ack),
+            buffer( CAPACITY ) {}
+
+    DescriptorSource( const DescriptorSource& ) = delete;
+    DescriptorSource& operator=( const DescriptorSource& ) = delete;
+
+    ~DescriptorSource() {
+        reply();
+        if( owned )
+            close( fd );
+    }
+
+    /** @brief Дождаться одного соединения на порту port
+     *  @exception FileNotOpen() Порт занят или соединение не принято
+     * */
+    static std::unique_ptr<DescriptorSource> listen( const uint16_t& port ) {
+        const int server = socket( AF_INET, SOCK_STREAM, 0 );
+        if( server < 0 )
+            throw FileNotOpen( "Не удалось открыть сокет" );
+        const int yes = 1;
+        setsockopt( server, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes) );
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl( INADDR_ANY );
+        address.sin_port = htons( port );
+        if( ( bind( server, reinterpret_cast<const sockaddr*>( &address ), sizeof(address) ) != 0 ) ||
+                ( ::listen( server, 1 ) != 0 ) ) {
+            close( server );
+            throw FileNotOpen( "Порт недоступен: " + std::to_string( port ) );
+        }
+        LOG( INFO, "listen", "---> Ожидание соединения на порту " << port );
+        Logger::instance().flush();
+        const int client = accept( server, nullptr, nullptr );
+        close( server );
+        if( client < 0 )
+            throw FileNotOpen( "Соединение не принято: " + std::to_string( port ) );
+        return std::make_unique<DescriptorSource>( client, true, true );
+    }
+
+    bool next( std::string_view& line ) override {
+        reply();
+        while( true ) {
+            const char* first = ( buffer.data() + begin );
+            const char* nl = static_cast<const char*>( std::memchr( first, '\n', ( end - begin ) ) );
+            // строка длиннее буфера отдается частями
+            if( ( nl == nullptr ) && ( ( end - begin ) == buffer.size() ) )
+                nl = ( first + buffer.size() );
+            if( nl != nullptr ) {
+                size_t length = size_t( nl - first );
+                begin += std::min( ( length + 1 ), ( end - begin ) );
+                if( ( length != 0 ) && ( first[( length - 1 )] == '\r' ) )
+                    --length;
+                line = std::string_view( first, length );
+                pending = true;
+                return true;
+            }
+            if( !fill() ) {
+                if( begin == end )
+                    return false;
+                line = std::string_view( ( buffer.data() + begin ), ( end - begin ) );
+                begin = end;
+                pending = true;
+                return true;
+            }
+        }
+    }
+
+    /** @brief Размер неизвестен
+     * */
+    size_t size() const noexcept override { return 0; }
+
+    size_t bytes() const noexcept { return received; }
+};
+
+enum class InputMode {
+    STREAM,  // std::ifstream + std::getline
+    MMAP     // mmap всего файла
+};
+
+
+/** @brief Запись скомпилированной траектории (.gtp): код команды и до WORDS слов строки.
+ *         Слово хранится и как Fixed из текста, и как float: Fixed не восстанавливается из float без потерь,
+ *         а параллельный разбор и кеш должны давать исполнителям те же значения, что и разбор строки.
+ *         Строки с большим числом слов продолжаются записями с кодом CONTINUATION
+ * */
+struct ToolpathRecord {
+    static constexpr size_t WORDS = 8;
+    static constexpr Opcode CONTINUATION = 0xFFFFFFFF;
+
+    Opcode opcode;
+    uint8_t size;
+    char letters[WORDS];
+    uint8_t reserved[3];
+    Fixed fixed[WORDS];
+    float values[WORDS];
+
+    /** @brief Упаковать команду в одну или несколько записей
+     *  @param emit Вызывается для каждой готовой записи
+     * */
+    template<typename Emit>
+    static void pack( const Opcode& op, const GCodeLine::cfp* pairs, const size_t& size, Emit&& emit ) {
+        size_t i = 0;
+        do {
+            ToolpathRecord rec{};
+            rec.opcode = ( ( i == 0 ) ? op : CONTINUATION );
+            for( ; ( ( i < size ) && ( rec.size < WORDS ) ); ++i, ++rec.size ) {
+                rec.letters[rec.size] = pairs[i].first;
+                rec.fixed[rec.size] = pairs[i].fixed;
+                rec.values[rec.size] = pairs[i].second;
+            }
+            emit( rec );
+        } while( i < size );
+    }
+};
+static_assert( sizeof(ToolpathRecord) == 112, "ToolpathRecord должен иметь фиксированный размер" );
+
+/** @brief Заголовок файла .gtp. За ним сразу идут records записей ToolpathRecord
+ * */
+struct ToolpathHeader {
+    static constexpr uint32_t MAGIC = 0x31505447;  // "GTP1"
+    static constexpr uint32_t VERSION = 4;  // 4: Fixed значения слов
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t reserved;
+    uint64_t sourceSize;
+    uint64_t sourceHash;
+    uint64_t records;
+    uint64_t reserved2;
+    SlicerHeader slicer;
+};
+static_assert( sizeof(ToolpathHeader) == 80, "ToolpathHeader должен иметь фиксированный размер" );
+
+/** @brief Пишет .gtp во временный файл и переименовывает его в итоговый только после commit(),
+ *         поэтому оборванный разбор не оставляет испорченный кеш
+ * */
+class ToolpathWriter {
+    using cfp = GCodeLine::cfp;
+    static constexpr size_t BUFFER_RECORDS = 4096;
+
+    std::string path;
+    std::string tmpPath;
+    std::ofstream outFile;
+    std::vector<ToolpathRecord> buffer;
+    uint64_t records;
+
+    void flush() {
+        outFile.write( reinterpret_cast<const char*>( buffer.data() ), ( buffer.size() * sizeof(ToolpathRecord) ) );
+        buffer.clear();
+    }
+
+public:
+    explicit ToolpathWriter( const std::string& fileName ) : path(fileName), tmpPath(fileName + ".tmp"),
+            outFile(tmpPath, std::ios::binary | std::ios::trunc), records(0) {
+        if( !outFile )
+            throw FileNotOpen( tmpPath );
+        const ToolpathHeader header{};
+        outFile.write( reinterpret_cast<const char*>( &header ), sizeof(header) );
+        buffer.reserve( BUFFER_RECORDS );
+    }
+
+    ~ToolpathWriter() {
+        if( outFile.is_open() ) {
+            outFile.close();
+            std::remove( tmpPath.c_str() );
+        }
+    }
+
+    void append( const Opcode& op, const cfp* pairs, const size_t& size ) {
+        ToolpathRecord::pack( op, pairs, size, [this]( const ToolpathRecord& rec ) {
+            buffer.push_back( rec );
+            ++records;
+            if( buffer.size() == BUFFER_RECORDS )
+                flush();
+        } );
+    }
+
+    /** @brief Дописать заголовок и опубликовать файл
+     *  @param sourceSize Размер исходного G-code
+     *  @param sourceHash fnv1a64 исходного G-code
+     *  @param slicer Подсказки заголовка слайсера
+     * */
+    void commit( const uint64_t& sourceSize, const uint64_t& sourceHash, const SlicerHeader& slicer ) {
+        flush();
+        ToolpathHeader header{};
+        header.magic = ToolpathHeader::MAGIC;
+        header.version = ToolpathHeader::VERSION;
+        header.recordSize = sizeof(ToolpathRecord);
+        header.sourceSize = sourceSize;
+        header.sourceHash = sourceHash;
+        header.records = records;
+        header.slicer = slicer;
+        outFile.seekp( 0 );
+        outFile.write( reinterpret_cast<const char*>( &header ), sizeof(header) );
+        outFile.close();
+        if( !outFile || ( std::rename( tmpPath.c_str(), path.c_str() ) != 0 ) ) {
+            std::remove( tmpPath.c_str() );
+            throw FileNotOpen( path );
+        }
+    }
+};
+
+/** @brief Отображает .gtp в память и проверяет, что он собран из текущей версии исходного файла
+ * */
+class ToolpathReader {
+    std::unique_ptr<MappedSource> mapped;
+    const ToolpathRecord* first;
+    size_t count;
+    SlicerHeader slicer;
+
+public:
+    ToolpathReader() : first(nullptr), count(0) {}
+
+    /** @brief Открыть кеш
+     *  @param fileName Путь к .gtp
+     *  @param source Исходный G-code, с которым сверяются размер и хеш
+     *  @return false, если кеша нет или он устарел
+     * */
+    bool open( const std::string& fileName, const MappedSource& source ) {
+        struct stat st;
+        if( stat( fileName.c_str(), &st ) != 0 )
+            return false;
+        mapped = std::make_unique<MappedSource>( fileName );
+        const std::string_view data = mapped->view();
+        if( data.size() < sizeof(ToolpathHeader) )
+            return false;
+        const ToolpathHeader* header = reinterpret_cast<const ToolpathHeader*>( data.data() );
+        if( ( header->magic != ToolpathHeader::MAGIC ) || ( header->version != ToolpathHeader::VERSION ) ||
+                ( header->recordSize != sizeof(ToolpathRecord) ) || ( header->sourceSize != source.size() ) ||
+                ( ( data.size() - sizeof(ToolpathHeader) ) != ( header->records * sizeof(ToolpathRecord) ) ) )
+            return false;
+        if( header->sourceHash != fnv1a64( source.view() ) )
+            return false;
+        first = reinterpret_cast<const ToolpathRecord*>( data.data() + sizeof(ToolpathHeader) );
+        count = header->records;
+        slicer = header->slicer;
+        return true;
+    }
+
+    const SlicerHeader& header() const noexcept { return slicer; }
+
+    const ToolpathRecord* begin() const noexcept { return first; }
+    const ToolpathRecord* end() const noexcept { return ( first + count ); }
+    size_t size() const noexcept { return count; }
+};
+
+/** @brief Параллельный разбор отображенного в память файла.
+ *         Файл делится на куски по границам строк, пул потоков разбирает куски в пакеты ToolpathRecord,
+ *         а единственный потребитель забирает пакеты строго в исходном порядке. Пакеты лежат в ограниченном
+ *         кольце слотов без блокировок: seq == 2k - слот свободен для куска k, seq == 2k + 1 - пакет куска k готов
+ * */
+class ParsePipeline {
+public:
+    static constexpr size_t CHUNK_SIZE = ( 1 << 20 );
+
+    struct Batch {
+        std::vector<ToolpathRecord> records;
+        size_t bytes = 0;
+        size_t errorAt = SIZE_MAX;  // число записей до строки, на которой разбор куска прервался
+        std::exception_ptr error;
+    };
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> seq;
+        Batch batch;
+    };
+    static constexpr uint64_t STOPPED = UINT64_MAX;
+
+    std::string_view data;
+    std::vector<size_t> bounds;
+    size_t slotCount;
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<size_t> nextChunk;
+    std::atomic<bool> stopped;
+    std::vector<std::thread> workers;
+
+    bool waitFor( std::atomic<uint64_t>& seq, const uint64_t& expected ) {
+        for( uint64_t v = seq.load( std::memory_order_acquire ); v != expected;
+                v = seq.load( std::memory_order_acquire ) ) {
+            if( ( v == STOPPED ) || stopped.load( std::memory_order_acquire ) )
+                return false;
+            seq.wait( v, std::memory_order_acquire );
+        }
+        return true;
+    }
+
+    void parseChunk( GCodeLine& line, const size_t& k, Batch& batch ) {
+        PROFILE_SCOPE( PARSE );
+        batch.records.clear();
+        batch.bytes = ( bounds[k + 1] - bounds[k] );
+        batch.errorAt = SIZE_MAX;
+        batch.error = nullptr;
+        const std::string_view chunk = data.substr( bounds[k], batch.bytes );
+        for( size_t pos = 0; pos < chunk.size(); ) {
+            size_t nl = chunk.find( '\n', pos );
+            if( nl == std::string_view::npos )
+                nl = chunk.size();
+            PROFILE_COUNT( LINES, 1 );
+            try {
+                if( line.parse( chunk.substr( pos, ( nl - pos ) ) ) ) {
+                    const Opcode op = decodeOpcode( line.command() );
+                    if( op == 0 )
+                        throw UnknownGCode( std::string( line.command() ) );
+                    ToolpathRecord::pack( op, line.data(), line.size(), [&batch]( const ToolpathRecord& rec ) {
+                        batch.records.push_back( rec );
+                    } );
+                }
+            } catch ( ... ) {
+                batch.errorAt = batch.records.size();
+                batch.error = std::current_exception();
+                return;
+            }
+            pos = ( nl + 1 );
+        }
+    }
+
+    void work() {
+        GCodeLine line;
+        for( size_t k = nextChunk.fetch_add( 1 ); k < chunks(); k = nextChunk.fetch_add( 1 ) ) {
+            Slot& slot = slots[( k % slotCount )];
+            if( !waitFor( slot.seq, ( 2 * k ) ) )
+                return;
+            parseChunk( line, k, slot.batch );
+            slot.seq.store( ( 2 * k + 1 ), std::memory_order_release );
+            slot.seq.notify_all();
+        }
+    }
+
+public:
+    /** @param content Весь файл
+     *  @param threads Количество потоков разбора
+     * */
+    ParsePipeline( const std::string_view& content, const size_t& threads ) : data(content),
+            slotCount( ( 2 * threads ) ), slots( std::make_unique<Slot[]>( slotCount ) ), nextChunk(0),
+            stopped(false) {
+        for( size_t pos = 0; pos < data.size(); ) {
+            bounds.push_back( pos );
+            const size_t nl = data.find( '\n', std::min( ( pos + CHUNK_SIZE ), data.size() ) );
+            pos = ( ( nl == std::string_view::npos ) ? data.size() : ( nl + 1 ) );
+        }
+        bounds.push_back( data.size() );
+        for( size_t i = 0; i < slotCount; ++i )
+            slots[i].seq.store( ( 2 * i ) );
+        for( size_t i = 0; i < threads; ++i )
+            workers.emplace_back( &ParsePipeline::work, this );
+    }
+
+    ParsePipeline( const ParsePipeline& ) = delete;
+    ParsePipeline& operator=( const ParsePipeline& ) = delete;
+
+    ~ParsePipeline() {
+        stop();
+        for( auto& worker : workers )
+            worker.join();
+    }
+
+    size_t chunks() const noexcept { return ( bounds.size() - 1 ); }
+
+    /** @brief Дождаться пакета куска k. Вызывать по порядку k = 0, 1, ...
+     * */
+    const Batch& acquire( const size_t& k ) {
+        Slot& slot = slots[( k % slotCount )];
+        waitFor( slot.seq, ( 2 * k + 1 ) );
+        return slot.batch;
+    }
+
+    /** @brief Вернуть слот куска k для куска k + slotCount
+     * */
+    void release( const size_t& k ) {
+        Slot& slot = slots[( k % slotCount )];
+        slot.seq.store( ( 2 * ( k + slotCount ) ), std::memory_order_release );
+        slot.seq.notify_all();
+    }
+
+    /** @brief Остановить потоки разбора, например после ошибки у потребителя
+     * */
+    void stop() {
+        stopped.store( true, std::memory_order_release );
+        for( size_t i = 0; i < slotCount; ++i ) {
+            slots[i].seq.store( STOPPED, std::memory_order_release );
+            slots[i].seq.notify_all();
+        }
+    }
+};
+
+struct ArbitrOptions {
+    InputMode mode = InputMode::MMAP;
+    bool cache = false;   // использовать скомпилированную траекторию fileName + ".gtp"
+    size_t threads = 1;   // потоков разбора; больше 1 - параллельный конвейер (только для MMAP)
+    bool shard = false;   // разбирать целые слои на threads потоках, если исполнитель поддерживает fork()
+    bool incremental = false;  // пересчитывать только слои, чей текст изменился с прошлого разбора
+    float pixel = ( 1.0f / PIXELS_PER_MM );  // мм, точка растра: по ней выбирается число хорд дуг G2/G3
+};
+
+class Arbitr {
+private:
+    using cfp = GCodeLine::cfp;
+    std::unique_ptr<InputSource> input;
+    size_t fileSize;
+    size_t currentSize;
+    size_t lines = 0;
+    StepperMotor* motors;
+    GCodeLine line;
+    std::string fileName;
+    ArbitrOptions options;
+    std::unique_ptr<ToolpathWriter> compiler;
+    SlicerHeader slicer;
+    bool inHeader;
+
+    /** @brief Положение инструмента в мм по тексту программы: от него отсчитываются центр и
+     *         начало дуг G2/G3
+     * */
+    struct Position {
+        float x = 0, y = 0, z = 0, e = 0;
+        bool relative = false;  // G91
+    };
+    Position position;
+
+    static constexpr size_t MOVE_BATCH = 256;      // перемещений в одном вызове applyMoves()
+    std::vector<MoveRecord> moves;                 // накопленные G0/G1, передаются до любой другой команды
+    size_t moveBatch = MOVE_BATCH;
+
+    static constexpr size_t ARC_CORRECTION = 25;   // через столько хорд поворот пересчитывается точно
+
+    Axes getAxes( const cfp* pairs, const size_t& size ) {
+        Axes ax;
+        for( size_t i = 0; i < size; ++i ) {
+            switch( pairs[i].first ) {
+                case 'X':
+                    ax._x = pairs[i].second;
+                    break;
+                case 'Y':
+                    ax._y = pairs[i].second;
+                    break;
+                case 'Z':
+                    ax._z = pairs[i].second;
+                    break;
+                case 'E':
+                    ax._e = pairs[i].second;
+                    break;
+                case 'F':
+                    ax._f = pairs[i].second;
+                    break;
+                default:
+                    break;
+            }
+        }
+        return ax;
+    }
+
+    /** @brief Учесть в position слова X, Y, Z, E команды перемещения
+     * */
+    void advance( const cfp* pairs, const size_t& size ) {
+        for( size_t i = 0; i < size; ++i ) {
+            float* axis = nullptr;
+            switch( pairs[i].first ) {
+                case 'X': axis = &position.x; break;
+                case 'Y': axis = &position.y; break;
+                case 'Z': axis = &position.z; break;
+                case 'E': axis = &position.e; break;
+                default: break;
+            }
+            if( axis != nullptr )
+                *axis = ( position.relative ? ( *axis + pairs[i].second ) : pairs[i].second );
+        }
+    }
+
+    /** @brief G92: слова X, Y, Z, E задают положение без движения, без слов все оси обнуляются
+     * */
+    void assign( const cfp* pairs, const size_t& size ) {
+        bool any = false;
+        for( size_t i = 0; i < size; ++i ) {
+            switch( pairs[i].first ) {
+                case 'X': position.x = pairs[i].second; any = true; break;
+                case 'Y': position.y = pairs[i].second; any = true; break;
+                case 'Z': position.z = pairs[i].second; any = true; break;
+                case 'E': position.e = pairs[i].second; any = true; break;
+                default: break;
+            }
+        }
+        if( !any )
+            position = Position{ 0, 0, 0, 0, position.relative };
+    }
+
+    /** @brief Дуга G2/G3 из position в точку X, Y с центром I, J (смещение от начала) или радиусом R
+     *         (R < 0 - дуга больше половины окружности). Дуга заменяется хордами: их число выбирается
+     *         так, чтобы хорда отходила от дуги не больше чем на полточки растра options.pixel, но хорды не
+     *         были короче точки, то есть растет с длиной дуги. Поворот радиуса на шаг хорды считается один раз, точки
+     *         получаются умножением на него, а каждые ARC_CORRECTION хорд - точно через cos/sin.
+     *         E распределяется по хордам пропорционально, Z (смена слоя) передается с первой хордой.
+     *         Концы хорд считаются в Fixed от начала дуги; при G91 исполнителю передаются разности соседних
+     *         концов, поэтому их сумма в точности равна словам X, Y, E
+     *  @param target Исполнитель хорд
+     *  @param clockwise G2 - по часовой стрелке
+     *  @exception CNCException() Нет ни I/J, ни R, или радиус R меньше половины хорды
+     * */
+    void arc( StepperMotor& target, const cfp* pairs, const size_t& size, const bool& clockwise ) {
+        const Position start = position;
+        const float pixel = options.pixel, tolerance = ( pixel / 2 );
+        float i = 0, j = 0, r = 0, f = 0;
+        Fixed wx = 0, wy = 0, wz = 0, we = 0;
+        bool centered = false, radial = false, extrude = false, lift = false, hasX = false, hasY = false;
+        for( size_t k = 0; k < size; ++k ) {
+            switch( pairs[k].first ) {
+                case 'I': i = pairs[k].second; centered = true; break;
+                case 'J': j = pairs[k].second; centered = true; break;
+                case 'R': r = pairs[k].second; radial = true; break;
+                case 'X': wx = pairs[k].fixed; hasX = true; break;
+                case 'Y': wy = pairs[k].fixed; hasY = true; break;
+                case 'E': we = pairs[k].fixed; extrude = true; break;
+                case 'Z': wz = pairs[k].fixed; lift = true; break;
+                case 'F': f = pairs[k].second; break;
+                default: break;
+            }
+        }
+        advance( pairs, size );
+        const Position end = position;
+        const char* name = ( clockwise ? "G2" : "G3" );
+        if( radial && !centered ) {
+            const float dx = ( end.x - start.x ), dy = ( end.y - start.y );
+            const float d = std::hypot( dx, dy );
+            const float h2 = ( ( r - d / 2 ) * ( r + d / 2 ) );
+            if( ( d == 0 ) || ( h2 < -( tolerance * tolerance ) ) )
+                throw CNCException( std::string( name ) + ": радиус R меньше половины хорды" );
+            const float h = ( ( h2 > 0 ) ? std::sqrt( h2 ) : 0.0f );
+            const float side = ( ( clockwise != ( r < 0 ) ) ? -1.0f : 1.0f );
+            i = ( dx / 2 - side * h * dy / d );
+            j = ( dy / 2 + side * h * dx / d );
+        } else if( !centered )
+            throw CNCException( std::string( name ) + ": нет ни I/J, ни R" );
+
+        const float cx = ( start.x + i ), cy = ( start.y + j );
+        const float rx0 = -i, ry0 = -j;
+        const float radius = std::hypot( i, j );
+        const float ex = ( end.x - cx ), ey = ( end.y - cy );
+        float sweep = std::atan2( ( rx0 * ey - ry0 * ex ), ( rx0 * ex + ry0 * ey ) );
+        if( sweep < 0 )
+            sweep += ( 2 * std::numbers::pi_v<float> );
+        if( clockwise )
+            sweep -= ( 2 * std::numbers::pi_v<float> );
+        if( ( std::fabs( sweep ) < 1e-6f ) && ( start.x == end.x ) && ( start.y == end.y ) )
+            sweep = ( clockwise ? -2 : 2 ) * std::numbers::pi_v<float>;  // полная окружность
+
+        const float length = ( std::fabs( sweep ) * radius );
+        size_t chords = 1;
+        if( radius > tolerance ) {
+            const float step = ( 2 * std::acos( 1 - tolerance / radius ) );
+            chords = std::clamp<size_t>( size_t( std::ceil( std::fabs( sweep ) / step ) ), 1,
+                std::max<size_t>( 1, size_t( length / pixel ) ) );
+        }
+        const float theta = ( sweep / chords );
+        const float cosT = std::cos( theta ), sinT = std::sin( theta );
+        float rx = rx0, ry = ry0;
+        const bool relative = start.relative;
+        const Fixed sx = toFixed( start.x ), sy = toFixed( start.y ), se = toFixed( start.e );
+        const Fixed fx = ( relative ? ( sx + wx ) : ( hasX ? wx : sx ) );
+        const Fixed fy = ( relative ? ( sy + wy ) : ( hasY ? wy : sy ) );
+        const Fixed fe = ( relative ? ( se + we ) : we );
+        Fixed px = sx, py = sy, pe = se;  // конец предыдущей хорды
+        std::vector<MoveRecord> path( chords );
+        for( size_t k = 1; k <= chords; ++k ) {
+            MoveRecord& m = path[( k - 1 )];
+            m.work = extrude;
+            m.present = ( MoveRecord::X | MoveRecord::Y );
+            if( k == chords ) {
+                m.x = fx;
+                m.y = fy;
+            } else {
+                if( ( k % ARC_CORRECTION ) == 0 ) {
+                    const float a = ( theta * k );
+                    rx = ( rx0 * std::cos( a ) - ry0 * std::sin( a ) );
+                    ry = ( rx0 * std::sin( a ) + ry0 * std::cos( a ) );
+                } else {
+                    const float t = ( rx * cosT - ry * sinT );
+                    ry = ( rx * sinT + ry * cosT );
+                    rx = t;
+                }
+                m.x = toFixed( cx + rx );
+                m.y = toFixed( cy + ry );
+            }
+            if( relative ) {
+                m.x = ( m.x - std::exchange( px, m.x ) );
+                m.y = ( m.y - std::exchange( py, m.y ) );
+            }
+            if( ( k == 1 ) && lift ) {
+                m.z = wz;
+                m.present |= MoveRecord::Z;
+            }
+            if( ( k == 1 ) && ( f != 0 ) ) {
+                m.f = uint16_t( f );
+                m.present |= MoveRecord::F;
+            }
+            if( extrude ) {
+                m.e = ( se + ( fe - se ) * Fixed( k ) / Fixed( chords ) );
+                if( relative )
+                    m.e = ( m.e - std::exchange( pe, m.e ) );
+                m.present |= MoveRecord::E;
+            }
+        }
+        target.applyMoves( path );
+    }
+
+    static MoveRecord makeMove( const cfp* pairs, const size_t& size, const bool& work ) {
+        MoveRecord r;
+        r.work = work;
+        for( size_t i = 0; i < size; ++i ) {
+            switch( pairs[i].first ) {
+                case 'X': r.x = pairs[i].fixed; r.present |= MoveRecord::X; break;
+                case 'Y': r.y = pairs[i].fixed; r.present |= MoveRecord::Y; break;
+                case 'Z': r.z = pairs[i].fixed; r.present |= MoveRecord::Z; break;
+                case 'E': r.e = pairs[i].fixed; r.present |= MoveRecord::E; break;
+                case 'F': r.f = uint16_t( pairs[i].second ); r.present |= MoveRecord::F; break;
+                default: break;
+            }
+        }
+        return r;
+    }
+
+    void queueMove( const cfp* pairs, const size_t& size, const bool& work ) {
+        advance( pairs, size );
+        moves.push_back( makeMove( pairs, size, work ) );
+        if( moves.size() >= moveBatch )
+            flushMoves();
+    }
+
+    void flushMoves() {
+        if( moves.empty() )
+            return;
+        motors->applyMoves( moves );
+        moves.clear();
+    }
+
+    void G0( const cfp* pairs, const size_t& size ) {
+        queueMove( pairs, size, false );
+    }
+
+    void G1( const cfp* pairs, const size_t& size ) {
+        queueMove( pairs, size, true );
+    }
+
+    void G2( const cfp* pairs, const size_t& size ) {
+        arc( *motors, pairs, size, true );
+    }
+
+    void G3( const cfp* pairs, const size_t& size ) {
+        arc( *motors, pairs, size, false );
+    }
+
+    void G28( const cfp* pairs, const size_t& size ) {
+        LOG( DEBUG, "G28", "G28: Перейти в точку 0" );
+        position = Position{ 0, 0, 0, position.e, position.relative };
+        const MoveRecord home = MoveRecord::home();
+        motors->applyMoves( std::span<const MoveRecord>( &home, 1 ) );
+    }
+
+    void G90( const cfp* pairs, const size_t& size ) {
+        LOG( DEBUG, "G90", "G90: Установка абсолютных координат" );
+        position.relative = false;
+        motors->absoluteAxes();
+    }
+
+    void G91( const cfp* pairs, const size_t& size ) {
+        LOG( DEBUG, "G91", "G91: Установка относительных координат" );
+        position.relative = true;
+        motors->relativeAxes();
+    }
+
+    void G92( const cfp* pairs, const size_t& size ) {
+        LOG( DEBUG, "G92", "G92: сброс всех значений" );
+        assign( pairs, size );
+        motors->setting( Axes() );
+        for( size_t i = 0; i < size; ++i )
+            if( pairs[i].first == 'E' )
+                motors->resetExtruder( pairs[i].second );
+    }
+
+    void M82( const cfp* pairs, const size_t& size ) {
+        LOG( DEBUG, "M82", "M82: Установить экструдер в абсолютный режим" );
+    }
+
+    void M84( const cfp* pairs, const size_t& size ) {
+        LOG( DEBUG, "M84", "M84: Отключить моторы" );
+        motors->off();
+    }
+
+    void M104( const cfp* pairs, const size_t& size ) {
+        LOG( DEBUG, "M104", "M104: Установить температуру экструдера на "
+             << std::to_string(((int)pairs[0].second))
+             << " Градусов. Не ждать установки" );
+    }
+
+    void M105( const cfp* pairs, const size_t& size ) {
+        LOG( DEBUG, "M105", "M105: Получить данные о температуре экструдера и стола" );
+    }
+
+    void M106( const cfp* pairs, const size_t& size ) {
+        LOG( DEBUG, "M106", "M106: Включить вентилятор охлаждения модели. Мощность: "
+             << std::round( pairs[0].second / 255 * 100 ) << " %" );
+    }
+
+    void M107( const cfp* pairs, const size_t& size ) {
+        LOG( DEBUG, "M107", "M107: Выключить вентилятор охлаждения модели" );
+    }
+
+    void M109( const cfp* pairs, const size_t& size ) {
+        LOG( DEBUG, "M109", "M109: Установить температуру экструдера на "
+             << std::to_string(((int)pairs[0].second))
+             << " Градусов. Ждать установки" );
+    }
+
+    void M140( const cfp* pairs, const size_t& size ) {
+        LOG( DEBUG, "M140", "M140: Установить температуру стола на "
+             << std::to_string(((int)pairs[0].second))
+             << " Градусов. Не ждать установки" );
+    }
+
+    void M190( const cfp* pairs, const size_t& size ) {
+        LOG( DEBUG, "M190", "M190: Установить температуру стола на "
+             << std::to_string(((int)pairs[0].second))
+             << " Градусов. Ждать установки" );
+    }
+
+    using Handler = void (Arbitr::*)( const cfp*, const size_t& );
+    using Extension = std::function<void( const cfp*, const size_t& )>;
+
+    /** @brief Встроенные коды лежат в прямой таблице: G0..G1023 и M0..M1023
+     * */
+    static constexpr size_t TABLE_CODES = 1024;
+    using Table = std::array<Handler, ( 2 * TABLE_CODES )>;
+
+    std::unordered_map<Opcode, Extension> extensions;
+
+    static constexpr size_t tableIndex( const Opcode& op ) noexcept {
+        const uint32_t number = ( op & 0xFFFF );
+        if( number >= TABLE_CODES )
+            return Table().size();
+        switch( char( op >> 16 ) ) {
+            case 'G':
+                return number;
+            case 'M':
+                return ( TABLE_CODES + number );
+            default:
+                return Table().size();
+        }
+    }
+
+    static constexpr Table makeTable() {
+        Table table{};
+        const std::pair<Opcode, Handler> codes[] = {
+            { makeOpcode( 'G', 0 ), &Arbitr::G0 },
+            { makeOpcode( 'G', 1 ), &Arbitr::G1 },
+            { makeOpcode( 'G', 2 ), &Arbitr::G2 },
+            { makeOpcode( 'G', 3 ), &Arbitr::G3 },
+            { makeOpcode( 'G', 28 ), &Arbitr::G28 },
+            { makeOpcode( 'G', 90 ), &Arbitr::G90 },
+            { makeOpcode( 'G', 91 ), &Arbitr::G91 },
+            { makeOpcode( 'G', 92 ), &Arbitr::G92 },
+            { makeOpcode( 'M', 82 ), &Arbitr::M82 },
+            { makeOpcode( 'M', 84 ), &Arbitr::M84 },
+            { makeOpcode( 'M', 104 ), &Arbitr::M104 },
+            { makeOpcode( 'M', 105 ), &Arbitr::M105 },
+            { makeOpcode( 'M', 106 ), &Arbitr::M106 },
+            { makeOpcode( 'M', 107 ), &Arbitr::M107 },
+            { makeOpcode( 'M', 109 ), &Arbitr::M109 },
+            { makeOpcode( 'M', 140 ), &Arbitr::M140 },
+            { makeOpcode( 'M', 190 ), &Arbitr::M190 }
+        };
+        for( const auto& [op, handler] : codes )
+            table[tableIndex( op )] = handler;
+        return table;
+    }
+
+    static const Table& table() noexcept {
+        static constexpr Table builtin = makeTable();
+        return builtin;
+    }
+
+    /** @brief Выполнить команду по ее коду: сначала прямая таблица, затем зарегистрированные расширения
+     *  @exception UnknownGCode() Код не найден ни в таблице, ни в расширениях
+     * */
+    void dispatch( const Opcode& op, const cfp* pairs, const size_t& size ) {
+        PROFILE_SCOPE( DISPATCH );
+        PROFILE_OPCODE( op );
+        if( !moves.empty() && ( op != makeOpcode( 'G', 0 ) ) && ( op != makeOpcode( 'G', 1 ) ) )
+            flushMoves();
+        const size_t index = tableIndex( op );
+        if( ( index < table().size() ) && ( table()[index] != nullptr ) ) {
+            ( this->*table()[index] )( pairs, size );
+            return;
+        }
+        const auto it = extensions.find( op );
+        if( it == extensions.end() )
+            throw UnknownGCode( opcodeName( op ) );
+        it->second( pairs, size );
+    }
+
+    void callCode( const std::string_view& cmd, const cfp* pairs, const size_t& size ) {
+        const Opcode op = decodeOpcode( cmd );
+        if( op == 0 )
+            throw UnknownGCode( std::string( cmd ) );
+        if( compiler )
+            compiler->append( op, pairs, size );
+        dispatch( op, pairs, size );
+    }
+
+    /** @brief Сколько разобрано: доля файла, а для потока без размера - строки и байты
+     * */
+    std::string progress() const {
+        if( fileSize == 0 )
+            return ( "строка " + std::to_string( lines ) + ", байт " + std::to_string( currentSize ) );
+        std::ostringstream text;
+        text << ( std::round( float(currentSize) / float(fileSize) * 100.0 ) / 100.0 ) << " %";
+        return text.str();
+    }
+
+    int reportError( const std::exception& e ) {
+        LOG( ERROR, "progress", progress() );
+        LOG( ERROR, "error", e.what() );
+        return -1;
+    }
+
+    /** @brief Выполнить уже разобранные записи
+     *  @param applied Увеличивается на каждую выполненную запись
+     * */
+    void applyRecords( const ToolpathRecord* first, const ToolpathRecord* last, size_t& applied ) {
+        std::array<cfp, GCodeLine::CAPACITY> pairs;
+        while( first != last ) {
+            const Opcode op = first->opcode;
+            size_t size = 0;
+            do {
+                if( ( size + first->size ) > pairs.size() )
+                    throw CNCException( "Испорченная запись траектории: " + opcodeName( op ) );
+                for( size_t i = 0; i < first->size; ++i )
+                    pairs[size++] = cfp( first->letters[i], first->values[i], first->fixed[i] );
+                ++first;
+                ++applied;
+            } while( ( first != last ) && ( first->opcode == ToolpathRecord::CONTINUATION ) );
+            if( compiler )
+                compiler->append( op, pairs.data(), size );
+            dispatch( op, pairs.data(), size );
+        }
+    }
+
+    /** @brief Воспроизвести скомпилированную траекторию без разбора текста.
+     *         Прогресс при этом считается в записях, а не в байтах
+     * */
+    void replay( const ToolpathReader& reader ) {
+        fileSize = reader.size();
+        currentSize = 0;
+        slicer = reader.header();
+        endHeader();
+        applyRecords( reader.begin(), reader.end(), currentSize );
+    }
+
+    /** @brief Разбор в ParsePipeline, команды применяются к motors в этом потоке по порядку,
+     *         поэтому G90/G91/G92 и прочее модальное состояние обрабатываются так же, как при
+     *         последовательном разборе
+     * */
+    void makeParallel( const MappedSource& source ) {
+        const std::string_view data = source.view();
+        for( size_t pos = 0; pos < data.size(); ) {
+            const size_t nl = std::min( data.find( '\n', pos ), data.size() );
+            if( line.parse( data.substr( pos, ( nl - pos ) ) ) )
+                break;
+            headerLine( data.substr( pos, ( nl - pos ) ) );
+            pos = ( nl + 1 );
+        }
+        endHeader();
+        ParsePipeline pipeline( data, options.threads );
+        for( size_t k = 0, applied = 0; k < pipeline.chunks(); ++k ) {
+            const ParsePipeline::Batch& batch = pipeline.acquire( k );
+            const size_t count = std::min( batch.errorAt, batch.records.size() );
+            applyRecords( batch.records.data(), ( batch.records.data() + count ), applied );
+            currentSize += batch.bytes;
+            if( batch.error )
+                std::rethrow_exception( batch.error );
+            pipeline.release( k );
+        }
+    }
+
+    /** @brief Граница участка: строка G0/G1 со сменой слоя и состояние исполнителя перед ней
+     * */
+    struct LayerBoundary {
+        size_t offset;
+        float z;
+        MotionState state;
+        Position position;
+    };
+
+    /** @brief Быстрый проход без вывода: выполняются только команды, меняющие состояние исполнителя
+     * */
+    void trackState( StepperMotor& tracker, const Opcode& op, const cfp* pairs, const size_t& size ) {
+        switch( op ) {
+            case makeOpcode( 'G', 0 ):
+            case makeOpcode( 'G', 1 ): {
+                advance( pairs, size );
+                const MoveRecord r = makeMove( pairs, size, ( op == makeOpcode( 'G', 1 ) ) );
+                tracker.applyMoves( std::span<const MoveRecord>( &r, 1 ) );
+                break;
+            }
+            case makeOpcode( 'G', 2 ):
+            case makeOpcode( 'G', 3 ):
+                arc( tracker, pairs, size, ( op == makeOpcode( 'G', 2 ) ) );
+                break;
+            case makeOpcode( 'G', 28 ): {
+                position = Position{ 0, 0, 0, position.e, position.relative };
+                const MoveRecord home = MoveRecord::home();
+                tracker.applyMoves( std::span<const MoveRecord>( &home, 1 ) );
+                break;
+            }
+            case makeOpcode( 'G', 90 ):
+                position.relative = false;
+                tracker.absoluteAxes();
+                break;
+            case makeOpcode( 'G', 91 ):
+                position.relative = true;
+                tracker.relativeAxes();
+                break;
+            case makeOpcode( 'G', 92 ):
+                assign( pairs, size );
+                tracker.setting( Axes() );
+                for( size_t i = 0; i < size; ++i )
+                    if( pairs[i].first == 'E' )
+                        tracker.resetExtruder( pairs[i].second );
+                break;
+            case makeOpcode( 'M', 84 ):
+                tracker.off();
+                break;
+            default:
+                break;
+        }
+    }
+
+    /** @brief Выполнить строки text на своем исполнителе
+     * */
+    void runRange( const std::string_view& text ) {
+        for( size_t pos = 0; pos < text.size(); ) {
+            const size_t nl = std::min( text.find( '\n', pos ), text.size() );
+            PROFILE_COUNT( LINES, 1 );
+            bool parsed;
+            {
+                PROFILE_SCOPE( PARSE );
+                parsed = line.parse( text.substr( pos, ( nl - pos ) ) );
+            }
+            if( parsed )
+                callCode( line.command(), line.data(), line.size() );
+            pos = ( nl + 1 );
+        }
+        flushMoves();
+    }
+
+    /** @brief Участок разбора: слои [first, last) по номерам границ. Слой i - текст между границами
+     *         ( i - 1 ) и i, слой 0 начинается после заголовка. Слой boundaries.size() - хвост файла
+     *         после последней смены слоя, он ничего не сохраняет
+     * */
+    struct ShardRange {
+        size_t first;
+        size_t last;
+    };
+
+    /** @brief Разобрать заголовок в начале data
+     *  @return Смещение первой команды
+     * */
+    size_t readHeader( const std::string_view& data ) {
+        size_t start = 0;
+        for( ; start < data.size(); ) {
+            const size_t nl = std::min( data.find( '\n', start ), data.size() );
+            if( line.parse( data.substr( start, ( nl - start ) ) ) )
+                break;
+            PROFILE_COUNT( LINES, 1 );
+            headerLine( data.substr( start, ( nl - start ) ) );
+            start = ( nl + 1 );
+        }
+        endHeader();
+        return start;
+    }
+
+    /** @brief Предварительный проход: смещение каждой строки G0/G1 с Z и состояние tracker перед ней
+     * */
+    std::vector<LayerBoundary> prescan( const std::string_view& data, const size_t& start, StepperMotor& tracker ) {
+        PROFILE_SCOPE( PRESCAN );
+        std::vector<LayerBoundary> boundaries;
+        for( size_t pos = start; pos < data.size(); ) {
+            const size_t nl = std::min( data.find( '\n', pos ), data.size() );
+            if( line.parse( data.substr( pos, ( nl - pos ) ) ) ) {
+                const Opcode op = decodeOpcode( line.command() );
+                if( ( op >= makeOpcode( 'G', 0 ) ) && ( op <= makeOpcode( 'G', 3 ) ) ) {
+                    const Axes ax = getAxes( line.data(), line.size() );
+                    const MotionState st = tracker.state();
+                    if( ( ax._z != 0 ) && st.isWork )
+                        boundaries.push_back( LayerBoundary{ pos, ax._z, st, position } );
+                }
+                trackState( tracker, op, line.data(), line.size() );
+            }
+            pos = ( nl + 1 );
+        }
+        return boundaries;
+    }
+
+    /** @brief Выполнить участки на threads потоках, каждый своим Arbitr и своим исполнителем fork().
+     *         Участок начинается со строки смены слоя и заканчивается сохранением последнего слоя
+     *         с высотой Z следующей границы, поэтому слои и их номера совпадают с последовательным разбором
+     * */
+    void runShards( const std::string_view& data, const size_t& start, const std::vector<LayerBoundary>& boundaries,
+            const std::vector<ShardRange>& ranges ) {
+        std::vector<std::exception_ptr> errors( ranges.size() );
+        std::atomic<size_t> next( 0 );
+        const auto work = [&]() {
+            for( size_t k = next++; k < ranges.size(); k = next++ ) {
+                try {
+                    PROFILE_SCOPE( SHARD );
+                    const ShardRange& r = ranges[k];
+                    const std::unique_ptr<StepperMotor> motor = motors->fork( false );
+                    const size_t begin = ( ( r.first == 0 ) ? start : boundaries[( r.first - 1 )].offset );
+                    const size_t end = ( ( r.last > boundaries.size() ) ? data.size() : boundaries[( r.last - 1 )].offset );
+                    Arbitr shard( *this, motor.get() );
+                    if( r.first != 0 ) {
+                        motor->resume( boundaries[( r.first - 1 )].state );
+                        shard.position = boundaries[( r.first - 1 )].position;
+                    }
+                    shard.runRange( data.substr( begin, ( end - begin ) ) );
+                    if( r.last <= boundaries.size() )
+                        motor->endShard( boundaries[( r.last - 1 )].z );
+                } catch ( ... ) {
+                    errors[k] = std::current_exception();
+                }
+            }
+        };
+        std::vector<std::thread> pool;
+        for( size_t i = 1; i < std::min( std::max<size_t>( options.threads, 1 ), ranges.size() ); ++i )
+            pool.emplace_back( work );
+        work();
+        for( auto& thread : pool )
+            thread.join();
+        for( const std::exception_ptr& error : errors )
+            if( error )
+                std::rethrow_exception( error );
+    }
+
+    /** @brief Разбор по слоям: слои делятся на threads * 4 участка, которые выполняются параллельно
+     * */
+    void makeSharded( const MappedSource& source ) {
+        const std::string_view data = source.view();
+        const size_t start = readHeader( data );
+        const std::unique_ptr<StepperMotor> tracker = motors->fork( true );
+        if( !tracker ) {
+            makeSerial();
+            return;
+        }
+        const std::vector<LayerBoundary> boundaries = prescan( data, start, *tracker );
 
-    virtual void moveE( const Axes& ax ) = 0;
-    virtual void move( const Axes& ax ) = 0;
-    virtual void setting( const Axes& ax ) = 0;
+        const size_t count = std::min( ( std::max<size_t>( options.threads, 1 ) * 4 ), ( boundaries.size() + 1 ) );
+        std::vector<ShardRange> ranges;
+        for( size_t k = 0; k < count; ++k )
+            ranges.push_back( ShardRange{ ( ( k == 0 ) ? 0 : ( ( k * boundaries.size() ) / count + 1 ) ),
+                ( ( ( k + 1 ) * boundaries.size() ) / count + 1 ) } );
+        runShards( data, start, boundaries, ranges );
+        motors->resume( tracker->state() );
+        currentSize = data.size();
+    }
 
-    virtual void on() = 0;
-    virtual void off() = 0;
+    /** @brief Высота в имени файла слоя: с точностью 0.1 мм, как в MatrixMotor::layerPath()
+     * */
+    static long layerName( const float& z ) { return std::lround( z * 10 ); }
 
-    virtual void relativeAxes() = 0;
-    virtual void absoluteAxes() = 0;
-};
+    static uint64_t hashState( const MotionState& st, const Position& at, const float& z ) {
+        std::ostringstream text;
+        text << st._prevX << ',' << st._prevY << ',' << st._prevZ << ',' << st._prevE << ',' << st.extruder << ','
+             << st.layerZ << ',' << st.layerHeight << ',' << st.layers << ',' << st.isWork << ',' << at.x << ','
+             << at.y << ',' << at.z << ',' << at.e << ',' << at.relative << ',' << z;
+        return fnv1a64( text.str() );
+    }
 
-#define MATRIX_SCALER_SIZE 1000
-#define TABLE_SIZE 2.2
+    /** @brief Повторный разбор: хеш каждого слоя - его текст, состояние исполнителя перед ним и высота
+     *         следующей смены слоя. Слои, хеш которых совпал с прошлым разбором и файл которых на месте,
+     *         не рисуются и не кодируются, остальные выполняются участками, как в makeSharded().
+     *         Слои прошлого разбора, номера или высоты которых в новом файле нет, удаляются.
+     *         Индекс хешей удаляется до разбора и пишется заново только после успешной записи всех слоев
+     * */
+    void makeIncremental( const MappedSource& source ) {
+        const std::string_view data = source.view();
+        const size_t start = readHeader( data );
+        const std::string path = motors->layerHashPath();
+        const std::unique_ptr<StepperMotor> tracker = motors->fork( true );
+        if( path.empty() || !tracker ) {
+            LOG( WARN, "incremental", "Исполнитель не поддерживает выборочный пересчет слоев" );
+            if( tracker )
+                makeSharded( source );
+            else
+                makeSerial();
+            return;
+        }
+        const MotionState initial = tracker->state();
+        const Position origin = position;
+        const std::vector<LayerBoundary> boundaries = prescan( data, start, *tracker );
 
-class MatrixMotor : public StepperMotor {
-    int _prevX = 0, _prevY = 0, _prevZ = 0, _prevE = 0;
-    int _x = 0, _y = 0, _z = 0, _e = 0;
-    Matrix m;
+        std::vector<uint64_t> hashes( boundaries.size() );
+        for( size_t i = 0; i < boundaries.size(); ++i ) {
+            const size_t begin = ( ( i == 0 ) ? start : boundaries[( i - 1 )].offset );
+            hashes[i] = fnv1a64( data.substr( begin, ( boundaries[i].offset - begin ) ),
+                ( ( i == 0 ) ? hashState( initial, origin, boundaries[i].z ) :
+                    hashState( boundaries[( i - 1 )].state, boundaries[( i - 1 )].position, boundaries[i].z ) ) );
+        }
 
-    bool isWork;
-    void saveLayer( const float& layer ) {
-        static int i = 0;
-        std::string strL = std::to_string( ( std::round( layer * 10 ) / 10 ) );
-        strL = strL.substr( 0, ( strL.length() - 5 ) );
-        m.saveJpeg( ( "img/layer_" + std::to_string( i++ ) + "_" + strL + ".jpg" ) );
-        m.clear();
+        // слои прошлого разбора читаются при любом ключе: по ним же удаляются слои, которых больше нет
+        const uint64_t key = motors->outputKey();
+        std::vector<std::pair<float, uint64_t>> previous;  // высота и хеш слоя
+        std::ifstream old( path );
+        std::string text;
+        const bool sameKey = ( std::getline( old, text ) && ( text == ( "key," + std::to_string( key ) ) ) );
+        if( std::getline( old, text ) && ( text == "layer,z,hash" ) ) {
+            size_t i;
+            float z;
+            uint64_t hash;
+            while( ( old >> i ).ignore() >> z && ( old.ignore() >> hash ) )
+                if( i == previous.size() )
+                    previous.emplace_back( z, hash );
+        }
+        old.close();
+        std::remove( path.c_str() );
+        for( size_t i = 0; i < previous.size(); ++i )
+            if( ( i >= boundaries.size() ) || ( layerName( previous[i].first ) != layerName( boundaries[i].z ) ) )
+                motors->removeLayer( i, previous[i].first );
+        if( !sameKey )
+            previous.clear();
+
+        // хвост после последней смены слоя выполняется всегда: он ничего не рисует, но меняет состояние
+        const size_t limit = std::max<size_t>( 1, ( ( boundaries.size() + 1 ) /
+            ( std::max<size_t>( options.threads, 1 ) * 4 ) ) );
+        std::vector<ShardRange> ranges;
+        size_t changed = 0;
+        for( size_t i = 0; i <= boundaries.size(); ++i ) {
+            const bool same = ( ( i < boundaries.size() ) && ( i < previous.size() ) &&
+                ( previous[i].second == hashes[i] ) &&
+                motors->hasLayer( i, boundaries[i].z ) );
+            if( same )
+                continue;
+            changed += ( i < boundaries.size() );
+            if( !ranges.empty() && ( ranges.back().last == i ) && ( ( i - ranges.back().first ) < limit ) )
+                ++ranges.back().last;
+            else
+                ranges.push_back( ShardRange{ i, ( i + 1 ) } );
+        }
+        LOG( INFO, "incremental", "Слоев пересчитывается: " << changed << " из " << boundaries.size() );
+        runShards( data, start, boundaries, ranges );
+        motors->resume( tracker->state() );
+        currentSize = data.size();
+        flushMoves();
+        motors->flush();
+
+        std::ofstream index( path, std::ios::trunc );
+        index << "key," << key << "\nlayer,z,hash\n" << std::setprecision( 9 );
+        for( size_t i = 0; i < hashes.size(); ++i )
+            index << i << ',' << boundaries[i].z << ',' << hashes[i] << '\n';
+        if( !index )
+            LOG( WARN, "incremental", "Не удалось записать индекс хешей слоев: " << path );
     }
 
-public: 
-    MatrixMotor() {
-        Matrix mat( ( TABLE_SIZE * MATRIX_SCALER_SIZE ), ( TABLE_SIZE * MATRIX_SCALER_SIZE ) );
-        m = mat;
-        isWork = true;
+    /** @brief Исполнитель участка для makeSharded(): коды и расширения parent, без своего источника
+     * */
+    Arbitr( const Arbitr& parent, StepperMotor* m ) : fileSize( parent.fileSize ), currentSize(0), motors(m),
+            fileName( parent.fileName ), options( parent.options ), slicer( parent.slicer ), inHeader(false),
+            extensions( parent.extensions ) {}
+
+    void makeSerial() {
+        for( std::string_view strReaded = ""; input->next( strReaded ); ) {
+            currentSize += ( strReaded.size() + 1 );
+            ++lines;
+            PROFILE_COUNT( LINES, 1 );
+            if( inHeader )
+                headerLine( strReaded );
+            bool parsed;
+            {
+                PROFILE_SCOPE( PARSE );
+                parsed = line.parse( strReaded );
+            }
+            if( parsed ) {
+                endHeader();
+                callCode( line.command(), line.data(), line.size() );
+            }
+        }
     }
 
-    ~MatrixMotor() {}
+    /** @brief Заголовок слайсера - комментарии до первой команды
+     * */
+    void headerLine( const std::string_view& strReaded ) {
+        const size_t pos = strReaded.find_first_not_of( " \t" );
+        if( ( pos != std::string_view::npos ) && ( strReaded[pos] == ';' ) )
+            slicer.parse( strReaded.substr( pos ) );
+    }
 
-    void moveE( const Axes& ax ) override {
-        if( !isWork )
-            return;
+    void endHeader() {
+        if( std::exchange( inHeader, false ) ) {
+            if( slicer.fields != 0 )
+                motors->header( slicer );
+        }
+    }
 
-        _x = ( ( ax._x != 0 ) ? std::round( ax._x * 10 ) : _prevX );
-        _y = ( ( ax._y != 0 ) ? std::round( ax._y * 10 ) : _prevY );
-        if( ax._z != 0 )
-            saveLayer( ax._z );
+    std::string cachePath() const { return ( fileName + ".gtp" ); }
 
-        if( ( ( _prevX == _x ) && ( _prevY == _y ) ) )
-            return;
+public:
+    
+    /** @param fileName Файл G-code
+     *  @param m Исполнитель команд
+     *  @param opts Способ чтения и разбора. С cache скомпилированная траектория воспроизводится, если она
+     *              соответствует файлу, иначе собирается заново во время разбора
+     * */
+    Arbitr( const std::string& fileName, StepperMotor* m, const ArbitrOptions& opts = ArbitrOptions() ) :
+            fileSize(0), currentSize(0), fileName(fileName), options(opts), inHeader(true) {
+        if( options.mode == InputMode::MMAP )
+            input = std::make_unique<MappedSource>( fileName );
+        else
+            input = std::make_unique<StreamSource>( fileName );
+        fileSize = input->size();
+        motors = m;
+    }
 
-        m.drawLine( _prevX, _prevY, _x, _y, 255 );
-        setting( ax );
+    /** @brief Разбор из потока: строки выполняются по мере поступления, кеш и параллельный разбор
+     *         недоступны, прогресс считается в строках и байтах
+     *  @param source Источник строк, например DescriptorSource
+     *  @param name Имя для сообщений
+     * */
+    Arbitr( std::unique_ptr<InputSource> source, const std::string& name, StepperMotor* m,
+            const ArbitrOptions& opts = ArbitrOptions() ) : input( std::move( source ) ), fileSize(0), currentSize(0),
+            motors(m), fileName(name), options(opts), inHeader(true) {
+        options.cache = false;
+        moveBatch = 1;  // живой поток: перемещение выполняется сразу, а не после следующих строк
+        fileSize = input->size();
+    }
+    
+    ~Arbitr() {
+        if( input )
+            motors->off();
     }
 
-    void move( const Axes& ax ) override {
-        if( !isWork )
-            return;
+    /** @brief Зарегистрировать обработчик дополнительного кода (M117, G2/G3, M204, ...)
+     *  @param letter Буква команды
+     *  @param number Номер команды
+     *  @param handler Обработчик, получает слова строки так же, как встроенные коды
+     *  @exception CNCException() Код уже обрабатывается встроенной таблицей
+     * */
+    void registerCode( const char& letter, const uint32_t& number, Extension handler ) {
+        const Opcode op = makeOpcode( letter, number );
+        const size_t index = tableIndex( op );
+        if( ( index < table().size() ) && ( table()[index] != nullptr ) )
+            throw CNCException( "Код уже обрабатывается: " + opcodeName( op ) );
+        extensions[op] = std::move( handler );
+    }
 
-        _x = ( ( ax._x != 0 ) ? std::round( ax._x * 10 ) : _prevX );
-        _y = ( ( ax._y != 0 ) ? std::round( ax._y * 10 ) : _prevY );
-        if( ax._z != 0 )
-            saveLayer( ax._z );
-        
-        if( ( ( _prevX == _x ) && ( _prevY == _y ) ) )
-            return;
-        setting( ax );
+    int make() {
+        PROFILE_SCOPE( MAKE );
+        try {
+            if( options.cache ) {
+                ToolpathReader reader;
+                const MappedSource source( fileName );
+                if( reader.open( cachePath(), source ) ) {
+                    replay( reader );
+                    flushMoves();
+                    motors->flush();
+                    return 0;
+                }
+                try {
+                    compiler = std::make_unique<ToolpathWriter>( cachePath() );
+                } catch ( const FileNotOpen& fno ) {
+                    LOG( WARN, "cache", "Кеш траектории недоступен: " << fno.what() );
+                }
+            }
+            const MappedSource* mapped = dynamic_cast<const MappedSource*>( input.get() );
+            if( options.incremental && !compiler && ( mapped != nullptr ) )
+                makeIncremental( *mapped );
+            else if( options.shard && !compiler && ( mapped != nullptr ) )
+                makeSharded( *mapped );
+            else if( ( options.threads > 1 ) && ( mapped != nullptr ) )
+                makeParallel( *mapped );
+            else
+                makeSerial();
+            flushMoves();
+            motors->flush();
+        } catch ( const CNCException& ugc ) {
+            compiler.reset();
+            return reportError( ugc );
+        } catch ( const MatrixException& me ) {
+            compiler.reset();
+            return reportError( me );
+        }
+        if( compiler ) {
+            try {
+                const MappedSource source( fileName );
+                compiler->commit( source.size(), fnv1a64( source.view() ), slicer );
+            } catch ( const FileNotOpen& fno ) {
+                LOG( WARN, "cache", "Кеш траектории не записан: " << fno.what() );
+            }
+            compiler.reset();
+        }
+        return 0;
     }
+};
 
-    void setting( const Axes& ax ) override {
-        _prevX = ( ( ax._x != 0 ) ? std::round( ax._x * 10 ) : _prevX );
-        _prevY = ( ( ax._y != 0 ) ? std::round( ax._y * 10 ) : _prevX );
-        _prevZ = ( ( ax._z != 0 ) ? std::round( ax._z * 10 ) : _prevX );
-        _prevE = ( ( ax._e != 0 ) ? std::round( ax._e * 10 ) : _prevX );
+/** @brief Общий на все задачи пакета бюджет памяти под матрицы слоев в байтах. Задача резервирует сразу
+ *         весь нужный ей объем, поэтому задачи не могут заблокировать друг друга, захватив бюджет частично
+ * */
+class RasterBudget {
+    size_t capacity;
+    size_t used;
+    std::mutex mutex;
+    std::condition_variable released;
+
+public:
+    /** @param capacity Сколько байт матриц слоев может существовать одновременно
+     * */
+    explicit RasterBudget( const size_t& capacity ) : capacity( std::max<size_t>( capacity, 1 ) ), used(0) {}
+
+    /** @brief Зарезервировать count байт, ждет освобождения бюджета.
+     *         Задача больше всего бюджета получает весь бюджет, когда он свободен
+     *  @return Сколько реально зарезервировано, передать в release()
+     * */
+    size_t reserve( const size_t& count ) {
+        const size_t n = std::min( count, capacity );
+        std::unique_lock<std::mutex> lock( mutex );
+        released.wait( lock, [&]() { return ( ( used + n ) <= capacity ); } );
+        used += n;
+        return n;
     }
 
-    void on() override {
-        isWork = true;
-        std::cout << "---> Моторы включены" << std::endl;
+    void release( const size_t& count ) {
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            used -= count;
+        }
+        released.notify_all();
     }
+};
 
-    void off() override {
-        isWork = false;
-        std::cout << "---> Моторы отключены" << std::endl;
+struct BatchOptions {
+    size_t jobs = 1;              // файлов, обрабатываемых одновременно
+    size_t memory = 0;            // бюджет памяти под матрицы слоев в МиБ, 0 - без ограничения
+    std::string outputDir = "img"; // слои файла NAME.gcode пишутся в outputDir/NAME
+};
+
+/** @brief Пакетная обработка: у каждого файла своя пара Arbitr и MatrixMotor, файлы разбираются пулом потоков
+ * */
+class BatchRunner {
+    std::vector<std::string> files;
+    ArbitrOptions arbitrOptions;
+    MatrixMotorOptions motorOptions;
+    BatchOptions options;
+    RasterBudget budget;
+    std::atomic<size_t> next;
+    std::atomic<size_t> failed;
+
+    /** @brief Наибольший объем матриц одной задачи в байтах: слои в растеризации и в очереди записи,
+     *         плотные кадры и миниатюры потоков записи
+     * */
+    size_t rasterBytes() const {
+        const size_t side = motorOptions.machine.side();
+        return LayerWriter::peakBytes( side, side, motorOptions.writers, motorOptions.inFlight, motorOptions.mips );
     }
 
-    void relativeAxes() override {
-        std::cout << "---> Установлены относительные координаты" << std::endl;
+    void run( const std::string& file ) {
+        MatrixMotorOptions motor = motorOptions;
+        motor.outputDir = ( options.outputDir + "/" + std::filesystem::path( file ).stem().string() );
+        const size_t reserved = budget.reserve( rasterBytes() );
+        int rc = -1;
+        try {
+            std::filesystem::create_directories( motor.outputDir );
+            MatrixMotor mm( motor );
+            Arbitr arbitr( file, &mm, arbitrOptions );
+            rc = arbitr.make();
+        } catch ( const std::exception& e ) {
+            LOG( ERROR, "batch", file << ": " << e.what() );
+        }
+        budget.release( reserved );
+        if( rc != 0 )
+            ++failed;
     }
-    
-    void absoluteAxes() override {
-        std::cout << "---> Установлены абсолютные координаты" << std::endl;
+
+    void work() {
+        for( size_t i = next++; i < files.size(); i = next++ )
+            run( files[i] );
+    }
+
+public:
+    BatchRunner( std::vector<std::string> files, const ArbitrOptions& arbitrOptions,
+            const MatrixMotorOptions& motorOptions, const BatchOptions& options ) : files( std::move( files ) ),
+            arbitrOptions(arbitrOptions), motorOptions(motorOptions), options(options),
+            budget( ( options.memory == 0 ) ? std::numeric_limits<size_t>::max() :
+                ( options.memory << 20 ) ), next(0), failed(0) {}
+
+    /** @brief Список файлов пакета: все *.gcode каталога по имени или строки файла-списка
+     *  @exception FileNotOpen() Не удалось открыть список
+     * */
+    static std::vector<std::string> listFiles( const std::string& path ) {
+        std::vector<std::string> files;
+        std::error_code ec;
+        if( std::filesystem::is_directory( path, ec ) ) {
+            for( const auto& item : std::filesystem::directory_iterator( path, ec ) )
+                if( item.is_regular_file() && ( item.path().extension() == ".gcode" ) )
+                    files.push_back( item.path().string() );
+            std::sort( files.begin(), files.end() );
+            return files;
+        }
+        std::ifstream list( path );
+        if( !list )
+            throw FileNotOpen( path );
+        for( std::string line; std::getline( list, line ); ) {
+            while( !line.empty() && std::isspace( static_cast<unsigned char>( line.back() ) ) )
+                line.pop_back();
+            if( !line.empty() && ( line[0] != '#' ) )
+                files.push_back( line );
+        }
+        return files;
+    }
+
+    /** @return Количество файлов, обработанных с ошибкой
+     * */
+    size_t make() {
+        std::vector<std::thread> pool;
+        for( size_t i = 1; i < std::min( std::max<size_t>( options.jobs, 1 ), files.size() ); ++i )
+            pool.emplace_back( &BatchRunner::work, this );
+        work();
+        for( auto& thread : pool )
+            thread.join();
+        return failed;
     }
 };
 
-class Arbitr {
-private:
-    using cfp = std::pair<char, float>;
-    std::ifstream inFile;
-    size_t fileSize;
-    size_t currentSize;
-    StepperMotor* motors;
+enum class Workload {
+    INFILL,  // плотное заполнение: длинные параллельные линии через 0.4 мм
+    TINY,    // окружности из отрезков по 0.1 мм
+    LAYERS   // множество тонких слоев с одним периметром
+};
+
+struct GeneratorOptions {
+    Workload workload = Workload::INFILL;
+    size_t layers = 100;  // слоев, если bytes == 0
+    size_t bytes = 0;     // генерировать слои, пока файл меньше bytes
+    float side = 40;      // сторона квадрата модели, мм
+};
 
-    std::vector<std::string> split( const std::string &s, char delim ) {
-        std::vector<std::string> elems;
-        std::stringstream ss(s);
-        std::string item;
-        while( std::getline( ss, item, delim ) )
-            elems.push_back(item);
-        return elems;
+/** @brief Синтетический G-code для замеров: заголовок Cura, затем слои выбранного вида.
+ *         Размер ограничен только диском, файлы в гигабайты пишутся потоком
+ * */
+class GCodeGenerator {
+    static constexpr float CENTER = 110;
+    static constexpr float FEED = 0.033f;  // мм прутка на мм пути
+
+    FILE* out;
+    float x = CENTER, y = CENTER, e = 0;
+    size_t written = 0;
+    std::array<char, 128> line{};
+
+    template<typename... Args>
+    void emit( const char* format, Args... args ) {
+        const int n = std::snprintf( line.data(), line.size(), format, args... );
+        if( ( n > 0 ) && ( std::fwrite( line.data(), 1, size_t( n ), out ) != size_t( n ) ) )
+            throw FileNotOpen( "Ошибка записи синтетического G-code" );
+        written += size_t( std::max( n, 0 ) );
     }
 
-    cfp getCmdId( std::string id ) {
-        char code = id[0];
-        id.erase(0, 1);
-        return cfp( code, ( ( !id.empty() ) ? std::stof(id) : std::numeric_limits<float>::min() ) );
+    void travel( const float& tx, const float& ty ) {
+        emit( "G0 F6000 X%.3f Y%.3f\n", tx, ty );
+        x = tx;
+        y = ty;
     }
 
-    Axes getAxes( const cfp* pairs, const size_t& size ) {
-        Axes ax;
-        for( size_t i = 0; i < size; ++i ) {
-            switch( pairs[i].first ) {
-                case 'X':
-                    ax._x = pairs[i].second;
-                    break;
-                case 'Y':
-                    ax._y = pairs[i].second;
-                    break;
-                case 'Z':
-                    ax._z = pairs[i].second;
-                    break;
-                case 'E':
-                    ax._e = pairs[i].second;
-                    break;
-                case 'F':
-                    ax._f = pairs[i].second;
-                    break;
-                default:
-                    break;
+    void extrude( const float& tx, const float& ty ) {
+        e += ( std::hypot( ( tx - x ), ( ty - y ) ) * FEED );
+        emit( "G1 X%.3f Y%.3f E%.5f\n", tx, ty, e );
+        x = tx;
+        y = ty;
+    }
+
+    void layer( const GeneratorOptions& options, const size_t& k, const float& z ) {
+        const float lo = ( CENTER - options.side / 2 ), hi = ( CENTER + options.side / 2 );
+        emit( ";LAYER:%zu\nG0 F3000 Z%.3f\n", k, z );
+        switch( options.workload ) {
+            case Workload::INFILL: {
+                travel( lo, lo );
+                bool forward = true;
+                for( float v = lo; v <= hi; v += 0.4f, forward = !forward ) {
+                    if( v != lo )
+                        extrude( x, v );
+                    extrude( ( forward ? hi : lo ), v );
+                }
+                break;
+            }
+            case Workload::TINY: {
+                for( float r = 2; r < ( options.side / 2 ); r += 2 ) {
+                    const size_t steps = size_t( 2 * std::numbers::pi_v<float> * r / 0.1f );
+                    travel( ( CENTER + r ), CENTER );
+                    for( size_t i = 1; i <= steps; ++i ) {
+                        const float a = ( 2 * std::numbers::pi_v<float> * i / steps );
+                        extrude( ( CENTER + r * std::cos( a ) ), ( CENTER + r * std::sin( a ) ) );
+                    }
+                }
+                break;
             }
+            case Workload::LAYERS:
+                travel( lo, lo );
+                extrude( hi, lo );
+                extrude( hi, hi );
+                extrude( lo, hi );
+                extrude( lo, lo );
+                break;
         }
-        return ax;
     }
 
-    void G0( const cfp* pairs, const size_t& size ) {
-        Axes ax = getAxes( pairs, size );
-        motors->move( ax );
+public:
+    /** @brief Записать файл
+     *  @return Размер файла в байтах
+     *  @exception FileNotOpen() Файл не открылся или не записался
+     * */
+    static size_t write( const std::string& path, const GeneratorOptions& options ) {
+        GCodeGenerator generator;
+        generator.out = std::fopen( path.c_str(), "wb" );
+        if( generator.out == nullptr )
+            throw FileNotOpen( path );
+        std::vector<char> buffer( ( size_t(1) << 20 ) );
+        std::setvbuf( generator.out, buffer.data(), _IOFBF, buffer.size() );
+        try {
+            const float height = ( ( options.workload == Workload::LAYERS ) ? 0.05f : 0.2f );
+            const float lo = ( CENTER - options.side / 2 ), hi = ( CENTER + options.side / 2 );
+            generator.emit( ";FLAVOR:Marlin\n;Layer height: %.2f\n;MINX:%.1f\n;MINY:%.1f\n;MAXX:%.1f\n;MAXY:%.1f\n",
+                height, lo, lo, hi, hi );
+            generator.emit( "M82\nG92 E0\nG28\n" );
+            for( size_t k = 0; ( options.bytes != 0 ) ? ( generator.written < options.bytes ) : ( k < options.layers );
+                    ++k )
+                generator.layer( options, k, ( height * ( k + 1 ) ) );
+            generator.emit( "M84\n" );
+        } catch ( ... ) {
+            std::fclose( generator.out );
+            throw;
+        }
+        if( std::fclose( generator.out ) != 0 )
+            throw FileNotOpen( path );
+        return generator.written;
     }
+};
 
-    void G1( const cfp* pairs, const size_t& size ) {
-        Axes ax = getAxes( pairs, size );
-        motors->moveE( ax );
+#ifdef BENCHMARK
+/** @brief Исполнитель без действий, чтобы замерять только разбор и выбор кода
+ * */
+class NullMotor : public StepperMotor {
+public:
+    void moveE( const Axes& ax ) override {}
+    void move( const Axes& ax ) override {}
+    void setting( const Axes& ax ) override {}
+    void on() override {}
+    void off() override {}
+    void relativeAxes() override {}
+    void absoluteAxes() override {}
+};
+
+/** @brief Замеры разбора, выбора кода, рисования, очистки, кодирования и полных прогонов на синтетическом
+ *         G-code. Запуск: make bench, масштаб задается первым аргументом (1 - по умолчанию)
+ * */
+class Benchmark {
+    size_t scale;
+    std::string dir;
+    long startRss = 0;  // RSS в начале последнего замера, КиБ
+
+    /** @brief Поле /proc/self/status в КиБ, -1 - если его нет
+     * */
+    static long status( const std::string& field ) {
+        std::ifstream in( "/proc/self/status" );
+        std::string line;
+        while( std::getline( in, line ) )
+            if( line.compare( 0, field.size(), field ) == 0 )
+                return std::strtol( ( line.c_str() + field.size() ), nullptr, 10 );
+        return -1;
     }
 
-    void G28() {
-        std::cout << "G28: Перейти в точку 0" << std::endl;
-        motors->move( Axes() );
+    /** @brief Пик RSS с начала замера: seconds() сбрасывает VmHWM. Без /proc - пик за всю жизнь процесса
+     * */
+    static long peakRss() {
+        const long hwm = status( "VmHWM:" );
+        if( hwm >= 0 )
+            return hwm;
+        struct rusage usage;
+        getrusage( RUSAGE_SELF, &usage );
+        return usage.ru_maxrss;
     }
 
-    void G90() {
-        std::cout << "G90: Установка абсолютных координат" << std::endl;
-        motors->absoluteAxes();
+    /** @brief Дополнить пробелами до width символов. printf считает байты, и кириллица в UTF-8 сбивает столбцы
+     * */
+    static std::string pad( const std::string& text, const size_t& width ) {
+        const size_t chars = std::count_if( text.begin(), text.end(), []( const char& c ) {
+            return ( ( c & 0xC0 ) != 0x80 ); } );
+        return ( text + std::string( ( width - std::min( chars, width ) ), ' ' ) );
     }
 
-    void G91() {
-        std::cout << "G91: Установка относительных координат" << std::endl;
-        motors->relativeAxes();
+    template<typename Fn>
+    double seconds( Fn&& fn ) {
+        {
+            std::ofstream clear( "/proc/self/clear_refs" );
+            clear << "5";  // сбросить VmHWM до текущего RSS
+        }
+        startRss = std::max( status( "VmRSS:" ), 0L );
+        const auto start = std::chrono::steady_clock::now();
+        fn();
+        return std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
     }
 
-    void G92() {
-        std::cout << "G92: сброс всех значений" << std::endl;
-        motors->setting( Axes() );
+    void report( const std::string& name, const double& count, const std::string& unit, const double& time ) const {
+        const long peak = peakRss();
+        std::printf( "%s %14.0f %s %9.3f с   RSS пик %ld КиБ, +%ld\n", pad( name, 28 ).c_str(), ( count / time ),
+            pad( unit, 12 ).c_str(), time, peak, std::max( ( peak - startRss ), 0L ) );
+        std::fflush( stdout );
     }
 
-    void M82() {
-        std::cout << "M82: Установить экструдер в абсолютный режим" << std::endl;
+    /** @brief Найти файл в рабочем каталоге, рядом с программой или рядом с исходником
+     *  @return Путь или пустая строка, если файла нет нигде
+     * */
+    static std::string locate( const std::string& name ) {
+        std::error_code ec;
+        const std::filesystem::path exe = std::filesystem::read_symlink( "/proc/self/exe", ec );
+        for( const std::filesystem::path& base : { std::filesystem::current_path( ec ), exe.parent_path(),
+                std::filesystem::path( __FILE__ ).parent_path() } )
+            if( !base.empty() && std::filesystem::is_regular_file( ( base / name ), ec ) )
+                return ( base / name ).string();
+        return std::string();
     }
 
-    void M84() {
-        std::cout << "M84: Отключить моторы" << std::endl;
-        motors->off();
+    std::string generate( const std::string& name, GeneratorOptions options ) {
+        const std::string path = ( dir + "/" + name + ".gcode" );
+        GCodeGenerator::write( path, options );
+        return path;
     }
 
-    void M104( const cfp* pairs, const size_t& size ) {
-        std::cout << "M104: Установить температуру экструдера на "
-                  << std::to_string(((int)pairs[0].second))
-                  << " Градусов. Не ждать установки" << std::endl;
+    void parse( const std::string& path ) {
+        const MappedSource source( path );
+        GCodeLine line;
+        size_t lines = 0, words = 0;
+        const double time = seconds( [&]() {
+            const std::string_view data = source.view();
+            for( size_t pos = 0; pos < data.size(); ) {
+                const size_t nl = std::min( data.find( '\n', pos ), data.size() );
+                if( line.parse( data.substr( pos, ( nl - pos ) ) ) )
+                    words += line.size();
+                ++lines;
+                pos = ( nl + 1 );
+            }
+        } );
+        report( "GCodeLine::parse", double( lines ), "строк/с", time );
     }
 
-    void M105( const cfp* pairs, const size_t& size ) {
-        std::cout << "M105: Получить данные о температуре экструдера и стола" << std::endl;
+    void dispatch( const std::string& path ) {
+        NullMotor motor;
+        size_t lines = 0;
+        {
+            const MappedSource source( path );
+            const std::string_view data = source.view();
+            lines = std::count( data.begin(), data.end(), '\n' );
+        }
+        const double time = seconds( [&]() {
+            Arbitr arbitr( path, &motor );
+            arbitr.make();
+        } );
+        report( "Arbitr разбор + callCode", double( lines ), "строк/с", time );
     }
 
-    void M106( const cfp* pairs, const size_t& size ) {
-        std::cout << "M106: Включить вентилятор охлаждения модели. Мощность: "
-                  << std::round( pairs[0].second / 255 * 100 ) << " %" << std::endl;
+    void draw() {
+        Matrix m( MachineProfile().side(), MachineProfile().side() );
+        const size_t count = ( 200000 * scale );
+        uint32_t seed = 1;
+        const auto random = [&]() { seed = ( seed * 1664525u + 1013904223u ); return int( ( seed >> 8 ) % 2180 ); };
+        // короткие отрезки до 16 точек, как у типичной строки G1; концы не совпадают
+        std::vector<std::array<int, 4>> segments( count );
+        for( auto& seg : segments ) {
+            seg[0] = random();
+            seg[1] = random();
+            seg[2] = ( seg[0] + 1 + random() % 16 );
+            seg[3] = ( seg[1] + random() % 16 );
+        }
+        report( "Matrix::drawLine", double( count ), "отрезков/с", seconds( [&]() {
+            for( const auto& seg : segments )
+                m.drawLine( seg[0], seg[1], seg[2], seg[3], 255 );
+        } ) );
+
+        // те же отрезки в 1 точку, что у Matrix::drawLine, затем капсулы ширины 4 со сглаживанием, как в --antialias
+        const size_t threads = std::max( 1u, std::thread::hardware_concurrency() );
+        for( const float& width : { 0.0f, 4.0f } ) {
+            TiledMatrix tiled( m.getRows(), m.getCols() );
+            SegmentBuffer buffer;
+            for( const auto& seg : segments )
+                buffer.push( seg[0], seg[1], seg[2], seg[3], width );
+            report( ( ( width == 0 ) ? "TiledMatrix::drawSegments" : "drawSegments капсулы 4 AA" ), double( count ),
+                "отрезков/с", seconds( [&]() { tiled.drawSegments( buffer, 255, ( width != 0 ), threads ); } ) );
+        }
+
+        const size_t clears = ( 50 * scale );
+        report( "Matrix::clear", double( clears ), "слоев/с", seconds( [&]() {
+            for( size_t i = 0; i < clears; ++i )
+                m.clear();
+        } ) );
+
+        for( const auto& seg : segments )
+            m.drawLine( seg[0], seg[1], seg[2], seg[3], 255 );
+        const size_t saves = ( 5 * scale );
+        const std::string jpeg = ( dir + "/layer.jpg" );
+        report( "Matrix::saveJpeg", double( saves ), "слоев/с", seconds( [&]() {
+            for( size_t i = 0; i < saves; ++i )
+                m.saveJpeg( jpeg );
+        } ) );
+        for( const LayerFormat& format : { LayerFormat::QOI, LayerFormat::PBM, LayerFormat::PGM } ) {
+            EncoderOptions options;
+            options.format = format;
+            const std::unique_ptr<LayerEncoder> encoder = makeEncoder( options );
+            std::vector<uint8_t> bytes;
+            report( ( std::string( "encode " ) + encoder->extension() ), double( saves ), "слоев/с", seconds( [&]() {
+                for( size_t i = 0; i < saves; ++i )
+                    encoder->encode( m, bytes );
+            } ) );
+        }
     }
 
-    void M107() {
-        std::cout << "M107: Выключить вентилятор охлаждения модели" << std::endl;
+    void endToEnd( const std::string& name, const std::string& path ) {
+        MatrixMotorOptions options;
+        options.outputDir = ( dir + "/" + name );
+        options.crop = true;
+        options.writers = std::max( 1u, std::thread::hardware_concurrency() );
+        options.inFlight = ( options.writers + 1 );
+        std::filesystem::create_directories( options.outputDir );
+        size_t lines = 0;
+        {
+            const MappedSource source( path );
+            const std::string_view data = source.view();
+            lines = std::count( data.begin(), data.end(), '\n' );
+        }
+        size_t layers = 0;
+        uint64_t drawn = 0;
+        const double time = seconds( [&]() {
+            MatrixMotor motor( options );
+            {
+                Arbitr arbitr( path, &motor );
+                arbitr.make();
+            }
+            drawn = motor.segmentsDrawn();
+            for( const auto& item : std::filesystem::directory_iterator( options.outputDir ) )
+                layers += ( item.path().filename().string().rfind( "layer_", 0 ) == 0 );
+        } );
+        report( ( "полный прогон " + name ), double( lines ), "строк/с", time );
+        report( ( "полный прогон " + name ), double( drawn ), "отрезков/с", time );
+        report( ( "полный прогон " + name ), double( layers ), "слоев/с", time );
     }
 
-    void M109( const cfp* pairs, const size_t& size ) {
-        std::cout << "M109: Установить температуру экструдера на "
-                  << std::to_string(((int)pairs[0].second))
-                  << " Градусов. Ждать установки" << std::endl;
+public:
+    explicit Benchmark( const size_t& scale ) : scale( std::max<size_t>( scale, 1 ) ),
+            dir( ( std::filesystem::temp_directory_path() / "gcode_bench" ).string() ) {
+        std::filesystem::remove_all( dir );
+        std::filesystem::create_directories( dir );
     }
 
-    void M140( const cfp* pairs, const size_t& size ) {
-        std::cout << "M140: Установить температуру стола на "
-                  << std::to_string(((int)pairs[0].second))
-                  << " Градусов. Не ждать установки" << std::endl;
+    ~Benchmark() {
+        std::error_code ec;
+        std::filesystem::remove_all( dir, ec );
     }
 
-    void M190( const cfp* pairs, const size_t& size ) {
-        std::cout << "M190: Установить температуру стола на "
-                  << std::to_string(((int)pairs[0].second))
-                  << " Градусов. Ждать установки" << std::endl;
-    }
-
-    void callCode( const std::string& cmd, const cfp* pairs, const size_t& size ) {
-        if( cmd == "G0" )
-            G0( pairs, size );
-        else if( cmd == "G1" )
-            G1( pairs, size );
-        else if( cmd == "G28" )
-            G28();
-        else if( cmd == "G90" )
-            G90();
-        else if( cmd == "G91" )
-            G91();
-        else if( cmd == "G92" )
-            G92();
-        else if( cmd == "M82" )
-            M82();
-        else if( cmd == "M84" )
-            M84();
-        else if( cmd == "M104" )
-            M104( pairs, size );
-        else if( cmd == "M105" )
-            M105( pairs, size );
-        else if( cmd == "M106" )
-            M106( pairs, size );
-        else if( cmd == "M107" )
-            M107();
-        else if( cmd == "M109" )
-            M109( pairs, size );
-        else if( cmd == "M140" )
-            M140( pairs, size );
-        else if( cmd == "M190" )
-            M190( pairs, size );
+    void run() {
+        Logger::instance().configure( LogLevel::WARN, LogFormat::TEXT, false );
+        GeneratorOptions infill;
+        infill.layers = ( 100 * scale );
+        GeneratorOptions tiny;
+        tiny.workload = Workload::TINY;
+        tiny.layers = ( 20 * scale );
+        GeneratorOptions layers;
+        layers.workload = Workload::LAYERS;
+        layers.layers = ( 2000 * scale );
+        GeneratorOptions large;
+        large.bytes = ( scale << 26 );  // 64 МиБ на единицу масштаба
+
+        const std::string infillPath = generate( "infill", infill );
+        const std::string tinyPath = generate( "tiny", tiny );
+        const std::string layersPath = generate( "layers", layers );
+        std::string largePath;
+        report( "генератор G-code", double( large.bytes ), "байт/с", seconds( [&]() {
+            largePath = generate( "large", large );
+        } ) );
+
+        parse( largePath );
+        dispatch( largePath );
+        draw();
+        endToEnd( "infill", infillPath );
+        endToEnd( "tiny", tinyPath );
+        endToEnd( "layers", layersPath );
+        const std::string cube = locate( FILE_NAME );
+        if( cube.empty() )
+            std::printf( "полный прогон cube пропущен: нет %s\n", FILE_NAME.c_str() );
         else
-            throw UnknownGCode(cmd);
+            endToEnd( "cube", cube );
     }
+};
+#endif
 
-public:
-    
-    Arbitr( const std::string& fileName, StepperMotor* m ) : inFile(fileName), fileSize(0), currentSize(0) {
-        if( !inFile )
-            throw FileNotOpen( fileName );
-        inFile.seekg( 0, std::ios::end );
-        fileSize = inFile.tellg();
-        inFile.seekg(0);
-        motors = m;
-    }
-    
-    ~Arbitr() {
-        motors->off();
-        inFile.close();
+/** @brief Извлечь из архива слой с номером layer в файл
+ *  @param scale Уменьшение миниатюры, 1 - сам слой
+ * */
+int extractLayer( const std::string& archive, const size_t& layer, const std::string& fileName,
+        const size_t& scale = 1 ) {
+    try {
+        const LayerArchiveReader reader( archive );
+        for( size_t i = 0; i < reader.size(); ++i ) {
+            if( ( reader.entry( i ).layer != layer ) || ( reader.scale( i ) != scale ) )
+                continue;
+            std::vector<uint8_t> bytes;
+            reader.read( i, bytes );
+            writeFile( fileName, bytes );
+            return 0;
+        }
+        std::cout << "Слой " << layer << ( ( scale > 1 ) ? ( " (1/" + std::to_string( scale ) + ")" ) : "" )
+                  << " не найден в " << archive << std::endl;
+    } catch ( const MatrixException& me ) {
+        std::cout << me.what() << std::endl;
     }
+    return 1;
+}
 
-    int make() {
-        for( std::string strReaded = "", strClear = ""; inFile; std::getline( inFile, strReaded ) ) {
-            currentSize += ( strReaded.size() + 1 );
-            strClear = strReaded.substr( 0, strReaded.find(";") );
-            if( strClear.empty() )
-                continue;
-            auto commands = split( strClear, ' ' );
-            const size_t size = ( commands.size() - 1 );
-            cfp* pairs = new cfp[size];
-            const std::string cmd = commands[0];
-            for( size_t i = 1; i < commands.size(); ++i )
-                pairs[( i - 1 )] = getCmdId(commands[i]);
-            try {
-                callCode( cmd, pairs, size );
-            } catch ( const UnknownGCode& ugc ) {
-                delete[] pairs;
-                std::cout << ( std::round( float(currentSize) / float(fileSize) * 100.0 ) / 100.0 ) << " %" << std::endl;
-                std::cout << ugc.what() << std::endl;
-                return -1;
-            };
-            delete[] pairs;
+/** @brief Вывести перемещения слоя layer из списка отрезков в CSV
+ * */
+int dumpSegments( const std::string& list, const size_t& layer ) {
+    try {
+        const SegmentListReader reader( list );
+        if( layer >= reader.size() ) {
+            std::cout << "Слой " << layer << " не найден в " << list << std::endl;
+            return 1;
         }
+        std::cout << "# z=" << reader.entry( layer ).z << "\nx0,y0,x1,y1,e,feed,work\n";
+        reader.read( layer, []( const SegmentListMove& m ) {
+            std::cout << m.x0 << ',' << m.y0 << ',' << m.x1 << ',' << m.y1 << ',' << m.e << ',' << m.feed << ','
+                      << m.work << '\n';
+        } );
         return 0;
+    } catch ( const MatrixException& me ) {
+        std::cout << me.what() << std::endl;
+    }
+    return 1;
+}
+
+/** @brief Исполнитель для сверки разборов: сворачивает в fnv1a64 все перемещения и настройки осей
+ *         со значениями Fixed и масками присутствия слов
+ * */
+class MoveHashMotor final : public StepperMotor {
+    uint64_t digest = 0xcbf29ce484222325ULL;
+    size_t records = 0;
+
+    template<typename T>
+    void fold( const T& v ) {
+        digest = fnv1a64( std::string_view( reinterpret_cast<const char*>( &v ), sizeof(v) ), digest );
     }
+
+    void fold( const MoveRecord& r ) {
+        fold( r.x );
+        fold( r.y );
+        fold( r.z );
+        fold( r.e );
+        fold( r.f );
+        fold( r.present );
+        fold( r.work );
+        ++records;
+    }
+
+public:
+    uint64_t hash() const noexcept { return digest; }
+    size_t size() const noexcept { return records; }
+
+    void applyMoves( std::span<const MoveRecord> moves ) override {
+        for( const MoveRecord& r : moves )
+            fold( r );
+    }
+
+    void moveE( const Axes& ax ) override { fold( MoveRecord::fromAxes( ax, true ) ); }
+    void move( const Axes& ax ) override { fold( MoveRecord::fromAxes( ax, false ) ); }
+    void setting( const Axes& ax ) override { fold( MoveRecord::fromAxes( ax, false ) ); }
+    void on() override {}
+    void off() override {}
+    void relativeAxes() override {}
+    void absoluteAxes() override {}
+    void resetExtruder( const float& e ) override { fold( toFixed( e ) ); }
 };
 
-int main() {
+/** @brief Сверить последовательный и параллельный разбор, запись кеша .gtp и его воспроизведение:
+ *         исполнитель должен получить одни и те же перемещения. Кеш, которого не было до сверки, удаляется
+ *  @param threads Потоков параллельного разбора
+ *  @return 0, если все разборы совпали
+ * */
+int verifyParse( const std::string& file, const size_t& threads ) {
+    const std::string cache = ( file + ".gtp" );
     struct stat st;
-    if( !( ( stat( "img", &st ) == 0 ) && S_ISDIR(st.st_mode) ) )
-        if ( mkdir( "img", ( S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH ) ) != 0 )
-            throw;
-    MatrixMotor mm;
-    Arbitr arbitr( FILE_NAME, &mm );
-    return arbitr.make();
+    const bool cached = ( stat( cache.c_str(), &st ) == 0 );
+    if( cached )
+        std::remove( cache.c_str() );
+    struct Run {
+        const char* name;
+        ArbitrOptions options;
+    };
+    std::vector<Run> runs( 4 );
+    runs[0].name = "serial";
+    runs[1].name = "parallel";
+    runs[1].options.threads = std::max<size_t>( threads, 2 );
+    runs[2].name = "cache write";
+    runs[2].options.cache = true;
+    runs[3].name = "cache replay";
+    runs[3].options.cache = true;
+    int rc = 0;
+    uint64_t expected = 0;
+    for( size_t i = 0; i < runs.size(); ++i ) {
+        MoveHashMotor motor;
+        Arbitr arbitr( file, &motor, runs[i].options );
+        if( arbitr.make() != 0 ) {
+            rc = 1;
+            break;
+        }
+        std::cout << runs[i].name << ": " << motor.size() << " перемещений, " << std::hex << motor.hash() << std::dec
+                  << std::endl;
+        if( i == 0 )
+            expected = motor.hash();
+        else if( motor.hash() != expected )
+            rc = 1;
+    }
+    if( !cached )
+        std::remove( cache.c_str() );
+    std::cout << ( ( rc == 0 ) ? "Разборы совпадают" : "Разборы РАЗЛИЧАЮТСЯ" ) << std::endl;
+    return rc;
+}
+
+#ifdef BENCHMARK
+int main( int argc, char* argv[] ) {
+    try {
+        Benchmark benchmark( ( ( argc > 1 ) ? std::strtoul( argv[1], nullptr, 10 ) : 1 ) );
+        benchmark.run();
+    } catch ( const std::exception& e ) {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+#else
+/** @brief Записать синтетический G-code: вид infill|tiny|layers и размер в МиБ (0 - 100 слоев)
+ * */
+int generateGCode( const std::string& kind, const size_t& megabytes, const std::string& path ) {
+    GeneratorOptions options;
+    if( kind == "tiny" )
+        options.workload = Workload::TINY;
+    else if( kind == "layers" ) {
+        options.workload = Workload::LAYERS;
+        options.layers = 2000;
+    } else if( kind != "infill" ) {
+        std::cout << "Неизвестный вид нагрузки: " << kind << std::endl;
+        return 1;
+    }
+    options.bytes = ( megabytes << 20 );
+    try {
+        std::cout << path << ": " << GCodeGenerator::write( path, options ) << " байт" << std::endl;
+    } catch ( const FileNotOpen& fno ) {
+        std::cout << "Не удалось записать: " << fno.what() << std::endl;
+        return 1;
+    }
+    return 0;
 }
 
+int main( int argc, char* argv[] ) {
+    ArbitrOptions options;
+    MatrixMotorOptions motorOptions;
+    BatchOptions batchOptions;
+    std::string batch;
+    bool steps = false;
+    bool segmentList = false;  // список отрезков вместо растра
+    std::vector<std::string> tee;  // исполнители разветвителя: raster, vector, steps
+    TeeOptions teeOptions;
+    bool plan = false;
+    std::string stream;  // "-" - stdin, иначе порт TCP
+    RuntimeConfig config;
+    LogLevel logLevel = LogLevel::INFO;
+    LogFormat logFormat = LogFormat::TEXT;
+    bool logAsync = false;
+    std::string profile;
+    bool trace = false;
+    for( int i = 1; i < argc; ++i ) {
+        const std::string arg = argv[i];
+        if( arg == "--stream" )
+            options.mode = InputMode::STREAM;
+        else if( ( arg == "--input" ) && ( ( i + 1 ) < argc ) )
+            config.input = argv[++i];
+        else if( ( ( arg == "--machine" ) || ( arg == "--set" ) || ( arg == "--pixel" ) || ( arg == "--table" ) ||
+                ( arg == "--output" ) ) && ( ( i + 1 ) < argc ) ) {
+            const std::string value = argv[++i];
+            try {
+                if( arg == "--machine" )
+                    config.load( value );
+                else if( arg == "--set" ) {
+                    const size_t eq = value.find( '=' );
+                    if( eq == std::string::npos )
+                        throw CNCException( "--set: ожидается key=value: " + value );
+                    config.set( value.substr( 0, eq ), value.substr( eq + 1 ) );
+                } else
+                    config.set( ( ( arg == "--pixel" ) ? "pixel" : ( ( arg == "--table" ) ? "table_size" : "output" ) ),
+                        value );
+            } catch ( const FileNotOpen& fno ) {
+                std::cout << fno.what() << std::endl;
+                return 1;
+            } catch ( const CNCException& ce ) {
+                std::cout << ce.what() << std::endl;
+                return 1;
+            }
+        }
+        else if( ( arg == "--generate" ) && ( ( i + 3 ) < argc ) )
+            return generateGCode( argv[( i + 1 )], std::strtoul( argv[( i + 2 )], nullptr, 10 ), argv[( i + 3 )] );
+        else if( arg == "--cache" )
+            options.cache = true;
+        else if( arg == "--mmap" )
+            options.mode = InputMode::MMAP;
+        else if( ( arg == "--threads" ) && ( ( i + 1 ) < argc ) ) {
+            options.threads = std::strtoul( argv[++i], nullptr, 10 );
+            if( options.threads == 0 )
+                options.threads = std::max( 1u, std::thread::hardware_concurrency() );
+        } else if( ( arg == "--writers" ) && ( ( i + 1 ) < argc ) )
+            motorOptions.writers = std::max<size_t>( 1, std::strtoul( argv[++i], nullptr, 10 ) );
+        else if( ( arg == "--log" ) && ( ( i + 1 ) < argc ) ) {
+            static const std::pair<std::string_view, LogLevel> levels[] = {
+                { "trace", LogLevel::TRACE }, { "debug", LogLevel::DEBUG }, { "info", LogLevel::INFO },
+                { "warn", LogLevel::WARN }, { "error", LogLevel::ERROR }, { "off", LogLevel::OFF }
+            };
+            const std::string_view value = argv[++i];
+            const auto it = std::find_if( std::begin( levels ), std::end( levels ),
+                [&]( const auto& level ) { return ( level.first == value ); } );
+            if( it == std::end( levels ) ) {
+                std::cout << "Неизвестный уровень журнала: " << value << std::endl;
+                return 1;
+            }
+            logLevel = it->second;
+        } else if( arg == "--log-json" )
+            logFormat = LogFormat::JSON;
+        else if( arg == "--log-async" )
+            logAsync = true;
+        else if( ( ( arg == "--profile" ) || ( arg == "--trace" ) ) && ( ( i + 1 ) < argc ) ) {
+            profile = argv[++i];
+            trace = ( arg == "--trace" );
+        }
+        else if( arg == "--stdin" )
+            stream = "-";
+        else if( ( arg == "--listen" ) && ( ( i + 1 ) < argc ) )
+            stream = argv[++i];
+        else if( arg == "--shard" )
+            options.shard = true;
+        else if( arg == "--incremental" )
+            options.incremental = true;
+        else if( arg == "--steps" )
+            steps = true;
+        else if( arg == "--vector" )
+            segmentList = true;
+        else if( ( arg == "--tee" ) && ( ( i + 1 ) < argc ) ) {
+            std::istringstream list( argv[++i] );
+            for( std::string name; std::getline( list, name, ',' ); )
+                if( !name.empty() )
+                    tee.push_back( name );
+        } else if( arg == "--tee-threads" )
+            teeOptions.threaded = true;
+        else if( ( arg == "--verify" ) && ( ( i + 1 ) < argc ) )
+            return verifyParse( argv[( i + 1 )], std::max<size_t>( options.threads, 4 ) );
+        else if( ( arg == "--segments" ) && ( ( i + 2 ) < argc ) )
+            return dumpSegments( argv[( i + 1 )], std::strtoul( argv[( i + 2 )], nullptr, 10 ) );
+        else if( arg == "--plan" )
+            plan = true;
+        else if( arg == "--crop" )
+            motorOptions.crop = true;
+        else if( arg == "--capsule" )
+            motorOptions.capsule = true;
+        else if( arg == "--antialias" )
+            motorOptions.capsule = motorOptions.antialias = true;
+        else if( ( arg == "--filament" ) && ( ( i + 1 ) < argc ) )
+            motorOptions.filament = std::strtof( argv[++i], nullptr );
+        else if( ( arg == "--layer-height" ) && ( ( i + 1 ) < argc ) )
+            motorOptions.layerHeight = std::strtof( argv[++i], nullptr );
+        else if( ( arg == "--raster-threads" ) && ( ( i + 1 ) < argc ) ) {
+            motorOptions.rasterThreads = std::strtoul( argv[++i], nullptr, 10 );
+            if( motorOptions.rasterThreads == 0 )
+                motorOptions.rasterThreads = std::max( 1u, std::thread::hardware_concurrency() );
+        } else if( arg == "--archive" )
+            motorOptions.archive = true;
+        else if( ( arg == "--extract" ) && ( ( i + 3 ) < argc ) )
+            return extractLayer( argv[( i + 1 )], std::strtoul( argv[( i + 2 )], nullptr, 10 ), argv[( i + 3 )] );
+        else if( ( arg == "--extract-mip" ) && ( ( i + 4 ) < argc ) )
+            return extractLayer( argv[( i + 1 )], std::strtoul( argv[( i + 2 )], nullptr, 10 ), argv[( i + 4 )],
+                std::strtoul( argv[( i + 3 )], nullptr, 10 ) );
+        else if( ( arg == "--mips" ) && ( ( i + 1 ) < argc ) ) {
+            std::istringstream list( argv[++i] );
+            for( std::string scale; std::getline( list, scale, ',' ); )
+                if( std::strtoul( scale.c_str(), nullptr, 10 ) > 1 )
+                    motorOptions.mips.push_back( std::strtoul( scale.c_str(), nullptr, 10 ) );
+        }
+        else if( ( arg == "--format" ) && ( ( i + 1 ) < argc ) ) {
+            const std::string format = argv[++i];
+            if( format == "jpeg" )
+                motorOptions.encoder.format = LayerFormat::JPEG;
+            else if( format == "qoi" )
+                motorOptions.encoder.format = LayerFormat::QOI;
+            else if( format == "pbm" )
+                motorOptions.encoder.format = LayerFormat::PBM;
+            else if( format == "pgm" )
+                motorOptions.encoder.format = LayerFormat::PGM;
+            else {
+                std::cout << "Неизвестный формат слоев: " << format << std::endl;
+                return 1;
+            }
+        } else if( ( arg == "--quality" ) && ( ( i + 1 ) < argc ) )
+            motorOptions.encoder.quality = std::atoi( argv[++i] );
+        else if( arg == "--fast-dct" )
+            motorOptions.encoder.fastDct = true;
+        else if( ( arg == "--batch" ) && ( ( i + 1 ) < argc ) )
+            batch = argv[++i];
+        else if( ( arg == "--jobs" ) && ( ( i + 1 ) < argc ) ) {
+            batchOptions.jobs = std::strtoul( argv[++i], nullptr, 10 );
+            if( batchOptions.jobs == 0 )
+                batchOptions.jobs = std::max( 1u, std::thread::hardware_concurrency() );
+        } else if( ( arg == "--memory" ) && ( ( i + 1 ) < argc ) )
+            batchOptions.memory = std::strtoul( argv[++i], nullptr, 10 );
+        else if( ( arg == "--inflight" ) && ( ( i + 1 ) < argc ) )
+            motorOptions.inFlight = std::max<size_t>( 1, std::strtoul( argv[++i], nullptr, 10 ) );
+        else {
+            std::cout << "Неизвестный параметр: " << arg << std::endl;
+            return 1;
+        }
+    }
+    Logger::instance().configure( logLevel, logFormat, logAsync );
+    Profiler::instance().configure( profile, trace );
+    // отчет пишется после разрушения моторов и Arbitr, когда все рабочие потоки остановлены
+    struct ProfileReport {
+        ~ProfileReport() { Profiler::instance().dump(); }
+    } profileReport;
+    motorOptions.machine = config.machine;
+    options.pixel = ( 1.0f / float( config.machine.pixelsPerMm ) );
+    motorOptions.outputDir = batchOptions.outputDir = config.outputDir;
+    std::error_code created;
+    std::filesystem::create_directories( config.outputDir, created );
+    if( created ) {
+        std::cout << "Не удалось создать каталог: " << config.outputDir << std::endl;
+        return 1;
+    }
+    if( !batch.empty() ) {
+        try {
+            BatchRunner runner( BatchRunner::listFiles( batch ), options, motorOptions, batchOptions );
+            return ( ( runner.make() == 0 ) ? 0 : 1 );
+        } catch ( const FileNotOpen& fno ) {
+            std::cout << fno.what() << std::endl;
+            return 1;
+        }
+    }
+    // каждый участок держит свою матрицу слоя
+    if( options.shard || options.incremental )
+        motorOptions.inFlight = std::max( motorOptions.inFlight, ( options.threads + 1 ) );
+    const auto makeMotor = [&]( const std::string& name ) -> std::unique_ptr<StepperMotor> {
+        if( name == "steps" ) {
+            StepperSimulatorOptions simulator;
+            simulator.stepsPerMm = config.machine.stepsPerMm();
+            return std::make_unique<StepperSimulator>( simulator );
+        }
+        if( name == "vector" )
+            return std::make_unique<SegmentMotor>( ( motorOptions.outputDir + "/layers.gsl" ) );
+        if( name == "raster" )
+            return std::make_unique<MatrixMotor>( motorOptions );
+        return nullptr;
+    };
+    std::unique_ptr<StepperMotor> motor;
+    if( !tee.empty() ) {
+        std::vector<std::unique_ptr<StepperMotor>> backends;
+        for( const std::string& name : tee ) {
+            backends.push_back( makeMotor( name ) );
+            if( !backends.back() ) {
+                std::cout << "Неизвестный исполнитель: " << name << std::endl;
+                return 1;
+            }
+        }
+        motor = std::make_unique<TeeMotor>( std::move( backends ), teeOptions );
+    } else
+        motor = makeMotor( ( steps ? "steps" : ( segmentList ? "vector" : "raster" ) ) );
+    std::unique_ptr<MotionPlanner> planner;
+    if( plan ) {
+        PlannerOptions planOptions;
+        planOptions.report = ( motorOptions.outputDir + "/plan.csv" );
+        planner = std::make_unique<MotionPlanner>( motor.get(), planOptions );
+    }
+    StepperMotor* executor = ( planner ? static_cast<StepperMotor*>( planner.get() ) : motor.get() );
+    if( !stream.empty() ) {
+        try {
+            std::unique_ptr<InputSource> source;
+            if( stream == "-" )
+                source = std::make_unique<DescriptorSource>( STDIN_FILENO, false, false );
+            else
+                source = DescriptorSource::listen( std::strtoul( stream.c_str(), nullptr, 10 ) );
+            Arbitr arbitr( std::move( source ), stream, executor, options );
+            return arbitr.make();
+        } catch ( const FileNotOpen& fno ) {
+            std::cout << fno.what() << std::endl;
+            return 1;
+        }
+    }
+    Arbitr arbitr( config.input, executor, options );
+    return arbitr.make();
+}
+#endif
 